@@ -0,0 +1,382 @@
+// Throughput and latency benchmark for convert().
+//
+//   make bench && ./bench [-n rounds] [-s speed] [--json] [--compare] [file.png|dir ...]
+//
+// Runs every image of the corpus through convert() at each speed 1-10 (or
+// just -s) and reports images/s, input MB/s, p50/p99 latency and peak RSS.
+// The corpus is generated in memory (all PNG color types, 1-16 bit, interlaced
+// and not, 64x64 up to 1080p); PNG files and directories given on the command
+// line are added to it. --json prints one JSON object instead of the table,
+// for diffing between builds (`make bench-json`). --compare also times a
+// reused luaquant_context against the one-shot convert().
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "rwpng.h"
+#include "imagequant/libimagequant.h"
+#include "luaquant.h"
+
+typedef struct bench_image {
+  char *name;
+  char *data;
+  size_t size;
+} bench_image;
+
+typedef struct bench_corpus {
+  bench_image *images;
+  int count;
+  int capacity;
+} bench_corpus;
+
+typedef struct bench_stats {
+  int speed;
+  int calls;
+  int failed;
+  double seconds;
+  double bytes;
+  double p50_ms;
+  double p99_ms;
+  long peak_rss_kb;
+} bench_stats;
+
+static double now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static long peak_rss_kb(void)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static void add_image(bench_corpus *corpus, const char *name, char *data, size_t size)
+{
+  if (corpus->count == corpus->capacity) {
+    corpus->capacity = corpus->capacity ? corpus->capacity * 2 : 16;
+    corpus->images = realloc(corpus->images, corpus->capacity * sizeof(bench_image));
+  }
+  bench_image *image = &corpus->images[corpus->count++];
+  image->name = strdup(name);
+  image->data = data;
+  image->size = size;
+}
+
+// Smooth gradients with a little noise, so the quantizer has real work to do.
+// Each sample is bit_depth wide; palette images index a ramp of 2^bit_depth colors.
+static void generate_png(bench_corpus *corpus, unsigned int width, unsigned int height, int color_type, int bit_depth, int interlace)
+{
+  static const char *type_names[] = {"gray", "", "rgb", "palette", "gray_alpha", "", "rgba"};
+  int channels = color_type == PNG_COLOR_TYPE_RGB ? 3 : color_type == PNG_COLOR_TYPE_RGBA ? 4 :
+                 color_type == PNG_COLOR_TYPE_GRAY_ALPHA ? 2 : 1;
+  unsigned int max_value = (1u << bit_depth) - 1;
+  size_t row_bytes = ((size_t)width * channels * bit_depth + 7) / 8;
+  png_bytep row = calloc(row_bytes, 1);
+
+  char name[64];
+  snprintf(name, sizeof(name), "%s%d_%ux%u%s", type_names[color_type], bit_depth, width, height, interlace ? "_i" : "");
+
+  char *data = NULL;
+  size_t size = 0;
+  FILE *outfile = open_memstream(&data, &size);
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  png_init_io(png_ptr, outfile);
+  png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type,
+               interlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_color palette[256];
+    png_byte trans[256];
+    unsigned int i;
+    for(i = 0; i <= max_value; i++) {
+      palette[i].red = i * 255 / max_value;
+      palette[i].green = 255 - i * 255 / max_value;
+      palette[i].blue = (i * 97) & 255;
+      trans[i] = i ? 255 : 0;
+    }
+    png_set_PLTE(png_ptr, info_ptr, palette, max_value + 1);
+    png_set_tRNS(png_ptr, info_ptr, trans, max_value + 1, NULL);
+  }
+
+  png_write_info(png_ptr, info_ptr);
+  int passes = png_set_interlace_handling(png_ptr);
+
+  int pass;
+  for(pass = 0; pass < passes; pass++) {
+    unsigned int seed = 1;
+    unsigned int x, y;
+    for(y = 0; y < height; y++) {
+      memset(row, 0, row_bytes);
+      for(x = 0; x < width; x++) {
+        int c;
+        for(c = 0; c < channels; c++) {
+          seed = seed * 1103515245 + 12345;
+          unsigned int value;
+          if (channels - c == 1 && (color_type & PNG_COLOR_MASK_ALPHA)) {
+            value = x < width / 8 ? max_value * x / (width / 8 + 1) : max_value;
+          } else {
+            value = (unsigned int)(((x + c * y) * (double)max_value) / (width + c * height)) ^ ((seed >> 16) & (max_value >> 5));
+          }
+
+          size_t bit = ((size_t)x * channels + c) * bit_depth;
+          if (bit_depth == 16) {
+            row[bit / 8] = value >> 8;
+            row[bit / 8 + 1] = value;
+          } else {
+            row[bit / 8] |= value << (8 - bit_depth - bit % 8);
+          }
+        }
+      }
+      png_write_row(png_ptr, row);
+    }
+  }
+
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  fclose(outfile);
+  free(row);
+
+  add_image(corpus, name, data, size);
+}
+
+static void generate_corpus(bench_corpus *corpus)
+{
+  generate_png(corpus, 64, 64, PNG_COLOR_TYPE_RGBA, 8, 0);
+  generate_png(corpus, 256, 256, PNG_COLOR_TYPE_PALETTE, 4, 0);
+  generate_png(corpus, 512, 512, PNG_COLOR_TYPE_GRAY, 1, 0);
+  generate_png(corpus, 512, 512, PNG_COLOR_TYPE_GRAY_ALPHA, 8, 0);
+  generate_png(corpus, 640, 480, PNG_COLOR_TYPE_RGB, 8, 0);
+  generate_png(corpus, 640, 480, PNG_COLOR_TYPE_RGBA, 8, 1);
+  generate_png(corpus, 800, 600, PNG_COLOR_TYPE_PALETTE, 8, 1);
+  generate_png(corpus, 800, 600, PNG_COLOR_TYPE_RGB, 16, 0);
+  generate_png(corpus, 1024, 768, PNG_COLOR_TYPE_GRAY, 8, 0);
+  generate_png(corpus, 1920, 1080, PNG_COLOR_TYPE_RGBA, 8, 0);
+}
+
+static void load_file(bench_corpus *corpus, const char *path)
+{
+  FILE *infile = fopen(path, "rb");
+  if (!infile) {
+    fprintf(stderr, "bench: can't open %s\n", path);
+    return;
+  }
+  fseek(infile, 0, SEEK_END);
+  long size = ftell(infile);
+  fseek(infile, 0, SEEK_SET);
+
+  char *data = size > 0 ? malloc(size) : NULL;
+  if (data && fread(data, 1, size, infile) == (size_t)size) {
+    const char *name = strrchr(path, '/');
+    add_image(corpus, name ? name + 1 : path, data, size);
+  } else {
+    fprintf(stderr, "bench: can't read %s\n", path);
+    free(data);
+  }
+  fclose(infile);
+}
+
+static void load_path(bench_corpus *corpus, const char *path)
+{
+  struct stat st;
+  if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+    load_file(corpus, path);
+    return;
+  }
+
+  DIR *dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "bench: can't open %s\n", path);
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    size_t len = strlen(entry->d_name);
+    if (len > 4 && !strcasecmp(entry->d_name + len - 4, ".png")) {
+      char file[4096];
+      snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+      load_file(corpus, file);
+    }
+  }
+  closedir(dir);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, int count, double p)
+{
+  int index = (int)(p * (count - 1) + 0.5);
+  return count ? sorted[index] : 0;
+}
+
+// Converts every image rounds times (large ones proportionally fewer) and
+// collects the latency of each call.
+static bench_stats bench_speed(const bench_corpus *corpus, int speed, int rounds)
+{
+  bench_stats stats = {.speed = speed};
+  int capacity = corpus->count * rounds;
+  double *latencies = malloc(capacity * sizeof(double));
+
+  int i, r;
+  for(i = 0; i < corpus->count; i++) {
+    const bench_image *image = &corpus->images[i];
+    int n = image->size > 1000000 ? (rounds + 4) / 5 : rounds;
+    for(r = 0; r < n; r++) {
+      double start = now_ms();
+      luaquant_result *result = convert(image->data, image->size, speed);
+      double elapsed = now_ms() - start;
+
+      stats.failed += !result;
+      free_result(result);
+      latencies[stats.calls++] = elapsed;
+      stats.seconds += elapsed / 1000.0;
+      stats.bytes += image->size;
+    }
+  }
+
+  qsort(latencies, stats.calls, sizeof(double), compare_doubles);
+  stats.p50_ms = percentile(latencies, stats.calls, 0.50);
+  stats.p99_ms = percentile(latencies, stats.calls, 0.99);
+  stats.peak_rss_kb = peak_rss_kb();
+  free(latencies);
+  return stats;
+}
+
+static double bench_convert(const bench_image *image, int speed, int iterations)
+{
+  double start = now_ms();
+  int i;
+  for(i = 0; i < iterations; i++) {
+    free_result(convert(image->data, image->size, speed));
+  }
+  return (now_ms() - start) / iterations;
+}
+
+static double bench_context(const bench_image *image, int speed, int iterations)
+{
+  luaquant_options options = {.speed = speed};
+  luaquant_context *context = new_context(&options);
+
+  // warm up once so the buffers are already allocated, as in a long-running worker
+  free_result(context_convert(context, image->data, image->size));
+
+  double start = now_ms();
+  int i;
+  for(i = 0; i < iterations; i++) {
+    free_result(context_convert(context, image->data, image->size));
+  }
+  double elapsed = (now_ms() - start) / iterations;
+
+  free_context(context);
+  return elapsed;
+}
+
+static void print_json_string(const char *s)
+{
+  putchar('"');
+  for(; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      putchar('\\');
+    }
+    if ((unsigned char)*s >= 0x20) {
+      putchar(*s);
+    }
+  }
+  putchar('"');
+}
+
+int main(int argc, char **argv)
+{
+  int rounds = 5;
+  int first_speed = 1, last_speed = 10;
+  int json = 0, compare = 0;
+  bench_corpus corpus = {0};
+
+  generate_corpus(&corpus);
+
+  int i;
+  for(i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      first_speed = last_speed = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--json")) {
+      json = 1;
+    } else if (!strcmp(argv[i], "--compare")) {
+      compare = 1;
+    } else {
+      load_path(&corpus, argv[i]);
+    }
+  }
+  if (rounds < 1) {
+    rounds = 1;
+  }
+
+  double corpus_bytes = 0;
+  for(i = 0; i < corpus.count; i++) {
+    corpus_bytes += corpus.images[i].size;
+  }
+
+  if (json) {
+    printf("{\"rounds\": %d, \"images\": [", rounds);
+    for(i = 0; i < corpus.count; i++) {
+      printf(i ? ", " : "");
+      print_json_string(corpus.images[i].name);
+    }
+    printf("], \"corpus_bytes\": %.0f, \"speeds\": [", corpus_bytes);
+  } else {
+    printf("%d images, %.1f MB, %d rounds\n", corpus.count, corpus_bytes / 1e6, rounds);
+    printf("%5s %7s %6s %10s %8s %9s %9s %10s\n", "speed", "calls", "failed", "images/s", "MB/s", "p50 ms", "p99 ms", "peak RSS");
+  }
+
+  int speed;
+  for(speed = first_speed; speed <= last_speed; speed++) {
+    bench_stats stats = bench_speed(&corpus, speed, rounds);
+    double images_per_s = stats.seconds > 0 ? stats.calls / stats.seconds : 0;
+    double mb_per_s = stats.seconds > 0 ? stats.bytes / 1e6 / stats.seconds : 0;
+
+    if (json) {
+      printf("%s\n  {\"speed\": %d, \"calls\": %d, \"failed\": %d, \"images_per_s\": %.3f, \"mb_per_s\": %.3f, "
+             "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"peak_rss_kb\": %ld}",
+             speed == first_speed ? "" : ",", stats.speed, stats.calls, stats.failed, images_per_s, mb_per_s,
+             stats.p50_ms, stats.p99_ms, stats.peak_rss_kb);
+    } else {
+      printf("%5d %7d %6d %10.2f %8.2f %9.3f %9.3f %7ld KB\n", stats.speed, stats.calls, stats.failed,
+             images_per_s, mb_per_s, stats.p50_ms, stats.p99_ms, stats.peak_rss_kb);
+    }
+    fflush(stdout);
+  }
+
+  if (json) {
+    printf("\n]}\n");
+  }
+
+  if (compare && !json) {
+    printf("\n%-24s %10s %14s %14s\n", "image", "calls", "convert ms", "context ms");
+    for(i = 0; i < corpus.count; i++) {
+      int n = corpus.images[i].size > 1000000 ? (rounds + 4) / 5 : rounds;
+      double one_shot = bench_convert(&corpus.images[i], last_speed, n);
+      double reused = bench_context(&corpus.images[i], last_speed, n);
+      printf("%-24s %10d %14.3f %14.3f\n", corpus.images[i].name, n, one_shot, reused);
+    }
+  }
+
+  for(i = 0; i < corpus.count; i++) {
+    free(corpus.images[i].name);
+    free(corpus.images[i].data);
+  }
+  free(corpus.images);
+  return 0;
+}
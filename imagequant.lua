@@ -0,0 +1,470 @@
+-- LuaJIT FFI binding for libluaquant.so (make dynamic).
+--
+-- q = require "imagequant"
+-- compressed, info = q.convert(original, 10)
+--
+-- Conversions return the PNG as a string and a table with quality, mse and
+-- stats, or nil and an error message. Options are tables with the fields of
+-- luaquant_options, e.g. {speed=10, quality_min=50, stream_rows=256}.
+
+local ffi = require "ffi"
+
+ffi.cdef [[
+typedef int pngquant_error;
+
+typedef struct luaquant_stats {
+  uint64_t images;
+  uint64_t failures;
+  uint64_t cache_hits;
+  uint64_t exact_palettes;
+  uint64_t too_low_quality;
+  uint64_t decode_ns;
+  uint64_t resize_ns;
+  uint64_t quantize_ns;
+  uint64_t remap_ns;
+  uint64_t encode_ns;
+  uint64_t total_ns;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t pixels;
+  uint64_t allocated;
+} luaquant_stats;
+
+typedef struct luaquant_result {
+  char *data;
+  size_t size;
+  int quality;
+  double mse;
+  luaquant_stats stats;
+} luaquant_result;
+
+typedef struct luaquant_options {
+  int speed;
+  int quality_min;
+  int quality_max;
+  int threads;
+  int stream_rows;
+  int stats;
+  int encode_threads;
+  int compression_level;
+  int compression_strategy;
+  int compression_mem_level;
+  int row_filters;
+  int time_budget_ms;
+  size_t max_size;
+  int resize_width;
+  int resize_height;
+  int resize_filter;
+  int dithering;
+  int remap_threads;
+  int chunks;
+  const char *keep_chunks;
+  int sample_pixels;
+  size_t max_pixels;
+  int sync;
+} luaquant_options;
+
+typedef struct luaquant_context luaquant_context;
+
+luaquant_result* convert(const char* bitmap, int len, int speed);
+luaquant_context* new_context(const luaquant_options *options);
+luaquant_result* context_convert(luaquant_context *context, const char *bitmap, int len);
+pngquant_error context_error(const luaquant_context *context);
+void free_context(luaquant_context *context);
+void free_result(luaquant_result *result);
+]]
+
+local lib = ffi.load("luaquant")
+
+-- values for luaquant_options fields, as in luaquant.h
+local q = {
+  COMPRESSION_AUTO = -1,
+  DITHER_NONE = -1,
+  SAMPLE_ALL = -1,
+  CHUNKS_UNKNOWN = 0,
+  CHUNKS_NONE = 1,
+  CHUNKS_ALL = 2,
+  RESIZE_BOX = 0,
+  RESIZE_LANCZOS = 1,
+}
+
+-- pngquant_error codes, as in rwpng.h
+local errors = {
+  [1] = "missing argument",
+  [2] = "read error",
+  [4] = "invalid argument",
+  [15] = "not overwriting",
+  [16] = "can't write",
+  [17] = "OOM",
+  [18] = "wrong architecture",
+  [24] = "PNG OOM",
+  [25] = "libpng fatal error",
+  [35] = "libpng init error",
+  [97] = "too many pixels",
+  [98] = "file too large",
+  [99] = "quality is too low",
+}
+q.errors = errors
+
+local function error_message(code)
+  return errors[code] or ("error " .. tonumber(code))
+end
+
+local stats_fields = {
+  "images", "failures", "cache_hits", "exact_palettes", "too_low_quality",
+  "decode_ns", "resize_ns", "quantize_ns", "remap_ns", "encode_ns", "total_ns",
+  "bytes_in", "bytes_out", "pixels", "allocated",
+}
+
+local function stats_table(stats)
+  local t = {}
+  for _, name in ipairs(stats_fields) do
+    t[name] = tonumber(stats[name])
+  end
+  return t
+end
+
+-- luaquant_options from a Lua table. The returned cdata borrows keep_chunks
+-- from the table, so keep the table alive as long as the options are used.
+local function options(opts)
+  local o = ffi.new("luaquant_options")
+  if opts then
+    for k, v in pairs(opts) do
+      o[k] = v
+    end
+  end
+  return o
+end
+
+-- Copies a luaquant_result into a string and an info table and frees it.
+local function take_result(result)
+  local data = ffi.string(result.data, result.size)
+  local info = {quality = result.quality, mse = result.mse, stats = stats_table(result.stats)}
+  lib.free_result(result)
+  return data, info
+end
+
+-- Use this function to compress PNG data using imagequant
+-- speed is 1-10, see convert() in luaquant.c.
+function q.convert(data, speed)
+  local result = lib.convert(data, #data, speed or 10)
+  if result == nil then
+    return nil, "conversion failed"
+  end
+  return take_result(result)
+end
+
+local Context = {}
+Context.__index = Context
+
+-- A reusable luaquant_context, freed when it's garbage collected.
+-- Like the C context, it must not be used from two threads at once.
+function q.new(opts)
+  opts = opts or {}
+  local context = lib.new_context(options(opts))
+  if context == nil then
+    return nil, "invalid argument"
+  end
+  -- keep_chunks must outlive the context
+  return setmetatable({context = ffi.gc(context, lib.free_context), keep_chunks = opts.keep_chunks}, Context)
+end
+
+-- Why the last conversion failed, or nil if it didn't.
+function Context:error()
+  local code = lib.context_error(self.context)
+  if code ~= 0 then
+    return error_message(code)
+  end
+end
+
+function Context:result(result)
+  if result == nil then
+    return nil, self:error()
+  end
+  return take_result(result)
+end
+
+function Context:convert(data)
+  return self:result(lib.context_convert(self.context, data, #data))
+end
+
+ffi.cdef [[
+typedef struct luaquant_indexed {
+  unsigned char *pixels;
+  unsigned int width;
+  unsigned int height;
+  double gamma;
+  unsigned int palette_count;
+  unsigned char palette[256][4];
+  int quality;
+  double mse;
+  luaquant_stats stats;
+} luaquant_indexed;
+
+luaquant_result* context_convert_rgba(luaquant_context *context, const unsigned char *rgba, int width, int height, int stride, double gamma);
+luaquant_indexed* context_quantize(luaquant_context *context, const char *bitmap, int len);
+luaquant_indexed* context_quantize_rgba(luaquant_context *context, const unsigned char *rgba, int width, int height, int stride, double gamma);
+void free_indexed(luaquant_indexed *indexed);
+]]
+
+-- pixels is a string or a pointer to width x height RGBA; stride 0 = width * 4,
+-- gamma 0 = sRGB.
+function Context:convert_rgba(pixels, width, height, stride, gamma)
+  return self:result(lib.context_convert_rgba(self.context, pixels, width, height, stride or 0, gamma or 0))
+end
+
+-- A luaquant_indexed, freed when it's garbage collected.
+function Context:indexed(indexed)
+  if indexed == nil then
+    return nil, self:error()
+  end
+  return ffi.gc(indexed, lib.free_indexed)
+end
+
+function Context:quantize(data)
+  return self:indexed(lib.context_quantize(self.context, data, #data))
+end
+
+function Context:quantize_rgba(pixels, width, height, stride, gamma)
+  return self:indexed(lib.context_quantize_rgba(self.context, pixels, width, height, stride or 0, gamma or 0))
+end
+
+ffi.cdef [[
+int convert_batch(const char *const *bitmaps, const int *lens, int count, const luaquant_options *options, luaquant_result **results);
+]]
+
+-- Pointers and lengths for a list of PNG strings. The strings stay owned by
+-- the list.
+local function bitmap_array(list)
+  local count = #list
+  local bitmaps = ffi.new("const char *[?]", count)
+  local lens = ffi.new("int[?]", count)
+  for i = 1, count do
+    bitmaps[i - 1] = list[i]
+    lens[i - 1] = #list[i]
+  end
+  return bitmaps, lens, count
+end
+
+-- Strings (or false for failures) from an array of count results.
+local function take_results(results, count)
+  local list = {}
+  for i = 0, count - 1 do
+    list[i + 1] = results[i] ~= nil and (take_result(results[i])) or false
+  end
+  return list
+end
+
+-- Returns a list of PNG strings, false where an image failed, and how many
+-- were converted.
+function q.convert_batch(list, opts)
+  local bitmaps, lens, count = bitmap_array(list)
+  local results = ffi.new("luaquant_result *[?]", count)
+  local converted = lib.convert_batch(bitmaps, lens, count, options(opts), results)
+  return take_results(results, count), converted
+end
+
+ffi.cdef [[
+typedef struct luaquant_job luaquant_job;
+
+luaquant_job* convert_async(const char *bitmap, int len, const luaquant_options *options);
+int job_ready(luaquant_job *job);
+luaquant_result* job_wait(luaquant_job *job);
+int async_fd(void);
+void free_job(luaquant_job *job);
+]]
+
+local Job = {}
+Job.__index = Job
+
+-- The job copies data and opts, so neither has to be kept. An unfinished job
+-- that is garbage collected is discarded by its worker.
+function q.convert_async(data, opts)
+  local job = lib.convert_async(data, #data, options(opts))
+  if job == nil then
+    return nil, "OOM"
+  end
+  return setmetatable({job = ffi.gc(job, lib.free_job)}, Job)
+end
+
+function Job:ready()
+  return lib.job_ready(self.job) ~= 0
+end
+
+-- Blocks until the job is done. Returns the PNG and its info table once.
+function Job:wait()
+  local result = lib.job_wait(self.job)
+  if result == nil then
+    return nil, "conversion failed"
+  end
+  return take_result(result)
+end
+
+function q.async_fd()
+  return lib.async_fd()
+end
+
+ffi.cdef [[
+typedef struct luaquant_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t entries;
+  size_t bytes;
+} luaquant_cache_stats;
+
+int palette_cache_configure(size_t max_bytes);
+void palette_cache_stats(luaquant_cache_stats *stats);
+]]
+
+-- bytes = 0 turns the cache off. Returns false if it couldn't be allocated.
+function q.palette_cache_configure(bytes)
+  return lib.palette_cache_configure(bytes) ~= 0
+end
+
+function q.palette_cache_stats()
+  local stats = ffi.new("luaquant_cache_stats")
+  lib.palette_cache_stats(stats)
+  return {
+    hits = tonumber(stats.hits),
+    misses = tonumber(stats.misses),
+    evictions = tonumber(stats.evictions),
+    entries = tonumber(stats.entries),
+    bytes = tonumber(stats.bytes),
+  }
+end
+
+ffi.cdef [[
+int convert_shared_palette(const char *const *bitmaps, const int *lens, int count, const luaquant_options *options, luaquant_result **results);
+]]
+
+function q.convert_shared_palette(list, opts)
+  local bitmaps, lens, count = bitmap_array(list)
+  local results = ffi.new("luaquant_result *[?]", count)
+  local converted = lib.convert_shared_palette(bitmaps, lens, count, options(opts), results)
+  return take_results(results, count), converted
+end
+
+ffi.cdef [[
+void cumulative_stats(luaquant_stats *stats);
+void reset_cumulative_stats(void);
+]]
+
+function q.cumulative_stats()
+  local stats = ffi.new("luaquant_stats")
+  lib.cumulative_stats(stats)
+  return stats_table(stats)
+end
+
+function q.reset_cumulative_stats()
+  lib.reset_cumulative_stats()
+end
+
+ffi.cdef [[
+typedef struct luaquant_variant {
+  int max_colors;
+  int quality_min;
+  int quality_max;
+} luaquant_variant;
+
+int convert_variants(const char *bitmap, int len, const luaquant_variant *variants, int count, const luaquant_options *options, luaquant_result **results);
+]]
+
+-- variants is a list of {max_colors=, quality_min=, quality_max=} tables.
+function q.convert_variants(data, variants, opts)
+  local count = #variants
+  local v = ffi.new("luaquant_variant[?]", count)
+  for i = 1, count do
+    for k, value in pairs(variants[i]) do
+      v[i - 1][k] = value
+    end
+  end
+  local results = ffi.new("luaquant_result *[?]", count)
+  local converted = lib.convert_variants(data, #data, v, count, options(opts), results)
+  return take_results(results, count), converted
+end
+
+ffi.cdef [[
+pngquant_error context_convert_file(luaquant_context *context, const char *in_path, const char *out_path);
+pngquant_error convert_file(const char *in_path, const char *out_path, const luaquant_options *options);
+]]
+
+function Context:convert_file(in_path, out_path)
+  local code = lib.context_convert_file(self.context, in_path, out_path)
+  if code ~= 0 then
+    return nil, error_message(code)
+  end
+  return true
+end
+
+function q.convert_file(in_path, out_path, opts)
+  local code = lib.convert_file(in_path, out_path, options(opts))
+  if code ~= 0 then
+    return nil, error_message(code)
+  end
+  return true
+end
+
+ffi.cdef [[
+typedef struct luaquant_chunk_count {
+  char name[5];
+  unsigned int count;
+  size_t bytes;
+} luaquant_chunk_count;
+
+typedef struct luaquant_probe {
+  unsigned int width;
+  unsigned int height;
+  int bit_depth;
+  int color_type;
+  int interlaced;
+  int complete;
+  unsigned int chunk_types;
+  luaquant_chunk_count chunks[32];
+  size_t idat_bytes;
+  size_t metadata_bytes;
+  size_t peak_memory;
+  uint64_t decode_pixels;
+  uint64_t quantize_pixels;
+  uint64_t remap_pixels;
+} luaquant_probe;
+
+pngquant_error probe(const char *bitmap, int len, const luaquant_options *options, luaquant_probe *info);
+]]
+
+-- The header and chunk list of a PNG and the rough cost of converting it with
+-- opts. Returns nil and an error for data that isn't a PNG; past max_pixels
+-- returns the info table and "too many pixels".
+function q.probe(data, opts)
+  local info = ffi.new("luaquant_probe")
+  local code = lib.probe(data, #data, options(opts), info)
+  if code ~= 0 and code ~= 97 then
+    return nil, error_message(code)
+  end
+  local chunks = {}
+  for i = 0, info.chunk_types - 1 do
+    local chunk = info.chunks[i]
+    chunks[i + 1] = {name = ffi.string(chunk.name), count = chunk.count, bytes = tonumber(chunk.bytes)}
+  end
+  local t = {
+    width = info.width,
+    height = info.height,
+    bit_depth = info.bit_depth,
+    color_type = info.color_type,
+    interlaced = info.interlaced ~= 0,
+    complete = info.complete ~= 0,
+    chunks = chunks,
+    idat_bytes = tonumber(info.idat_bytes),
+    metadata_bytes = tonumber(info.metadata_bytes),
+    peak_memory = tonumber(info.peak_memory),
+    decode_pixels = tonumber(info.decode_pixels),
+    quantize_pixels = tonumber(info.quantize_pixels),
+    remap_pixels = tonumber(info.remap_pixels),
+  }
+  if code ~= 0 then
+    return t, error_message(code)
+  end
+  return t
+end
+
+return q
@@ -6,11 +6,22 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <time.h>
+#include <math.h>
 #include <lauxlib.h>
 #include "rwpng.h"
 #include "imagequant/libimagequant.h"
 #include "luaquant.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#define omp_get_num_threads() 1
+#define omp_get_thread_num() 0
+#define omp_in_parallel() 0
+#endif
+
 /*
 pngquant_error check_error(lua_State *L, pngquant_error err, const char *context) {
   switch(err) {
@@ -33,39 +44,130 @@ pngquant_error check_error(lua_State *L, pngquant_error err, const char *context
 }
 */
 
-luaquant_result* write_image(png8_image *output_image)
+// The encoder writes into a buffer sized for the image up front, and that
+// buffer becomes the result as-is, so the output is never copied on the C side.
+static pngquant_error encode_image(png8_image *output_image, luaquant_result **result_p)
 {
-  FILE *outfile;
+  luaquant_result *result = (luaquant_result *) calloc(1, sizeof(luaquant_result));
+  if (!result) {
+    return OUT_OF_MEMORY_ERROR;
+  }
 
-  luaquant_result *result = (luaquant_result *) malloc(sizeof(luaquant_result));
+  unsigned char *data = NULL;
+  png_size_t size = 0;
+  pngquant_error retval;
+  retval = rwpng_write_image8(output_image, &data, &size);
 
-  off_t eob;
+  if (retval != SUCCESS) {
+    free(result);
+    return retval;
+  }
 
-  // we get the data as a string, but this code was originally written to work with a file handle.
-  // open_memstream is a convenient function that will make a string act like a file handle.
-  outfile = open_memstream(&result->data, &result->size);
-  pngquant_error retval;
-  retval = rwpng_write_image8(outfile, output_image);
-  // check_error(L, retval, "rwpng_write_image8");
-  fclose(outfile);
+  result->data = (char *)data;
+  result->size = size;
+  *result_p = result;
+  return SUCCESS;
+}
 
+luaquant_result* write_image(png8_image *output_image)
+{
+  luaquant_result *result = NULL;
+  encode_image(output_image, &result);
   return result;
 }
 
-pngquant_error read_image(liq_attr *options, const char *bitmap, png24_image *input_image_p, liq_image **liq_image_p, size_t *len)
+// Buffers from a previous image are reused when they're big enough.
+static int reserve_buffer(unsigned char **buffer, png_size_t *capacity, png_size_t size)
 {
-  FILE *infile;
-  infile = fmemopen(bitmap, *len, "rb");
+  if (*capacity < size) {
+    free(*buffer);
+    *buffer = malloc(size);
+    *capacity = *buffer ? size : 0;
+  }
+  return *buffer != NULL;
+}
+
+static int reserve_rows(unsigned char ***rows, png_uint_32 *capacity, png_uint_32 count)
+{
+  if (*capacity < count) {
+    free(*rows);
+    *rows = malloc(count * sizeof((*rows)[0]));
+    *capacity = *rows ? count : 0;
+  }
+  return *rows != NULL;
+}
+
+static void set_row_pointers(unsigned char **rows, unsigned char *base, unsigned int count, size_t stride)
+{
+  unsigned int row = 0;
+  for(row = 0;  row < count;  ++row) {
+    rows[row] = base + row*stride;
+  }
+}
+
+// With options.resize_width/height, scales the decoded image down in place.
+// The smaller pixels are written to *spare, which then trades places with
+// image->rgba_data, so a context keeps both buffers for the next image.
+static pngquant_error resize_image(const luaquant_options *options, png24_image *image, unsigned char **spare, png_size_t *spare_capacity)
+{
+  unsigned int width, height;
+  resize_fit(image->width, image->height, options->resize_width > 0 ? options->resize_width : 0,
+             options->resize_height > 0 ? options->resize_height : 0, &width, &height);
+  if (width == image->width && height == image->height) {
+    return SUCCESS;
+  }
+
+  // like the remap, one thread when already inside someone else's parallel region
+  const int threads = options->remap_threads ? options->remap_threads : omp_in_parallel() ? 1 : 0;
+  if (!reserve_buffer(spare, spare_capacity, (size_t)width * height * 4) ||
+      !resize_rgba(image->row_pointers, image->width, image->height, *spare, width, height, options->resize_filter, threads)) {
+    return OUT_OF_MEMORY_ERROR;
+  }
 
+  unsigned char *data = image->rgba_data;
+  png_size_t capacity = image->rgba_data_capacity;
+  image->rgba_data = *spare;
+  image->rgba_data_capacity = *spare_capacity;
+  *spare = data;
+  *spare_capacity = capacity;
+
+  image->width = width;
+  image->height = height;
+  set_row_pointers(image->row_pointers, image->rgba_data, height, (size_t)width * 4);
+  return SUCCESS;
+}
+
+// Size limit and which chunks the decoder keeps. The kept ones point into
+// the compressed input rather than being copied; every conversion is done
+// with them (and frees them) before it returns, while the caller still holds
+// the input.
+static void set_decode_options(const luaquant_options *options, png24_image *image)
+{
+  image->max_pixels = options->max_pixels;
+  image->chunk_policy = options->chunks;
+  image->keep_chunks = options->keep_chunks;
+  image->borrow_chunks = 1;
+}
+
+// Decodes bitmap, resizes it if options ask for it, and wraps the pixels in a liq_image.
+static pngquant_error decode_image(liq_attr *attr, const luaquant_options *options, const char *bitmap, size_t len,
+                                   png24_image *input_image, liq_image **liq_image_p, unsigned char **spare, png_size_t *spare_capacity)
+{
+  // libpng reads straight out of the caller's buffer, there's no FILE in between
   pngquant_error retval;
-  retval = rwpng_read_image24(infile, input_image_p, 0);
-  fclose(infile);
+  if (options) {
+    set_decode_options(options, input_image);
+  }
+  retval = rwpng_read_image24((const unsigned char *)bitmap, len, input_image, 0);
 
-  /* if (check_error(L, retval, "rwpng_read_image24")) { */
-  /*   return retval; */
-  /* } */
+  if (retval == SUCCESS && options && (options->resize_width > 0 || options->resize_height > 0)) {
+    retval = resize_image(options, input_image, spare, spare_capacity);
+  }
+  if (retval != SUCCESS) {
+    return retval;
+  }
 
-  *liq_image_p = liq_image_create_rgba_rows(options, (void**)input_image_p->row_pointers, input_image_p->width, input_image_p->height, input_image_p->gamma);
+  *liq_image_p = liq_image_create_rgba_rows(attr, (void**)input_image->row_pointers, input_image->width, input_image->height, input_image->gamma);
 
   if (!*liq_image_p) {
     return OUT_OF_MEMORY_ERROR;
@@ -74,6 +176,11 @@ pngquant_error read_image(liq_attr *options, const char *bitmap, png24_image *in
   return SUCCESS;
 }
 
+pngquant_error read_image(liq_attr *options, const char *bitmap, png24_image *input_image_p, liq_image **liq_image_p, size_t *len)
+{
+  return decode_image(options, NULL, bitmap, *len, input_image_p, liq_image_p, NULL, NULL);
+}
+
 pngquant_error prepare_output_image(liq_result *result, liq_image *input_image, png8_image *output_image)
 {
   output_image->width  = liq_image_get_width(input_image);
@@ -84,17 +191,12 @@ pngquant_error prepare_output_image(liq_result *result, liq_image *input_image,
    ** Step 3.7 [GRR]: allocate memory for the entire indexed image
    */
 
-  output_image->indexed_data = malloc(output_image->height * output_image->width);
-  output_image->row_pointers = malloc(output_image->height * sizeof(output_image->row_pointers[0]));
-
-  if (!output_image->indexed_data || !output_image->row_pointers) {
+  if (!reserve_buffer(&output_image->indexed_data, &output_image->indexed_data_capacity, (size_t)output_image->height * output_image->width) ||
+      !reserve_rows(&output_image->row_pointers, &output_image->row_pointers_capacity, output_image->height)) {
     return OUT_OF_MEMORY_ERROR;
   }
 
-  unsigned int row = 0;
-  for(row = 0;  row < output_image->height;  ++row) {
-    output_image->row_pointers[row] = output_image->indexed_data + row*output_image->width;
-  }
+  set_row_pointers(output_image->row_pointers, output_image->indexed_data, output_image->height, output_image->width);
 
   const liq_palette *palette = liq_get_palette(result);
   // tRNS, etc.
@@ -112,8 +214,11 @@ pngquant_error prepare_output_image(liq_result *result, liq_image *input_image,
 
 void set_palette(liq_result *result, png8_image *output_image)
 {
-  const liq_palette *palette = liq_get_palette(result);
+  set_palette_colors(liq_get_palette(result), output_image);
+}
 
+void set_palette_colors(const liq_palette *palette, png8_image *output_image)
+{
   // tRNS, etc.
   output_image->num_palette = palette->count;
   output_image->num_trans = 0;
@@ -128,40 +233,1465 @@ void set_palette(liq_result *result, png8_image *output_image)
   }
 }
 
+// Builds a result whose palette is exactly the given colors, for remapping
+// images to a palette that was computed earlier. libimagequant refuses to
+// quantize a histogram that only has fixed colors (LIQ_BITMAP_NOT_AVAILABLE),
+// so the colors go in as histogram entries too; being fixed, they come out
+// unchanged, and there are few enough of them that nothing is quantized.
+static liq_result* palette_result(liq_attr *attr, const liq_palette *palette, double gamma)
+{
+  liq_result *result = NULL;
+  liq_attr *fixed_attr = liq_attr_copy(attr);
+  liq_histogram *histogram = fixed_attr ? liq_histogram_create(fixed_attr) : NULL;
+  liq_histogram_entry entries[256];
+  unsigned int i;
+
+  for(i = 0; i < palette->count; i++) {
+    entries[i] = (liq_histogram_entry){.color = palette->entries[i], .count = 1};
+  }
+  if (histogram && palette->count &&
+      liq_set_max_colors(fixed_attr, palette->count < 2 ? 2 : palette->count) == LIQ_OK &&
+      liq_set_quality(fixed_attr, 0, 100) == LIQ_OK &&
+      liq_histogram_add_colors(histogram, fixed_attr, entries, palette->count, gamma) == LIQ_OK) {
+    for(i = 0; i < palette->count; i++) {
+      liq_histogram_add_fixed_color(histogram, palette->entries[i], gamma);
+    }
+    if (liq_histogram_quantize(histogram, fixed_attr, &result) != LIQ_OK) {
+      result = NULL;
+    }
+  }
+
+  if (histogram) liq_histogram_destroy(histogram);
+  if (fixed_attr) liq_attr_destroy(fixed_attr);
+  return result;
+}
+
+// libimagequant may reorder the colors of a fixed palette (and round them
+// through its gamma conversion), so its indices are translated back to the
+// caller's order. Returns 1 if no translation is needed.
+static int palette_lut(const liq_palette *own, const liq_palette *palette, unsigned char lut[256])
+{
+  int identity = own->count == palette->count;
+  unsigned int i, j;
+  for(i = 0; i < own->count; i++) {
+    unsigned int best = 0, best_diff = ~0u;
+    for(j = 0; j < palette->count && best_diff; j++) {
+      int dr = own->entries[i].r - palette->entries[j].r, dg = own->entries[i].g - palette->entries[j].g;
+      int db = own->entries[i].b - palette->entries[j].b, da = own->entries[i].a - palette->entries[j].a;
+      unsigned int diff = dr*dr + dg*dg + db*db + da*da;
+      if (diff < best_diff) {
+        best = j;
+        best_diff = diff;
+      }
+    }
+    lut[i] = best;
+    identity &= best == i;
+  }
+  return identity;
+}
+
+static void apply_lut(const unsigned char lut[256], unsigned char **row_pointers, unsigned int width, unsigned int height)
+{
+  unsigned int row, col;
+  for(row = 0; row < height; row++) {
+    for(col = 0; col < width; col++) {
+      row_pointers[row][col] = lut[row_pointers[row][col]];
+    }
+  }
+}
+
+// Remaps image onto exactly these colors, in this order. A liq_result keeps
+// its remapping state inside, so threads can't share one; this builds a
+// private result per call, which makes it safe to run on several threads at
+// once with the same palette.
+static pngquant_error remap_to_palette(liq_attr *attr, const liq_palette *palette, double gamma, float dithering, liq_image *image, unsigned char **row_pointers)
+{
+  liq_result *result = palette_result(attr, palette, gamma);
+  if (!result) {
+    return OUT_OF_MEMORY_ERROR;
+  }
+
+  unsigned char lut[256];
+  int identity = palette_lut(liq_get_palette(result), palette, lut);
+
+  liq_set_dithering_level(result, dithering);
+  liq_error err = liq_write_remapped_image_rows(result, image, row_pointers);
+  liq_result_destroy(result);
+  if (err != LIQ_OK) {
+    return OUT_OF_MEMORY_ERROR;
+  }
+
+  if (!identity) {
+    apply_lut(lut, row_pointers, liq_image_get_width(image), liq_image_get_height(image));
+  }
+  return SUCCESS;
+}
+
+// Images smaller than this are remapped on one thread
+#define REMAP_BAND_MIN_PIXELS (512 * 1024)
+// Rows remapped above each band and thrown away, so error diffusion is
+// already running when the band's first row is dithered, instead of
+// restarting there and leaving a visible line.
+#define REMAP_SEAM_ROWS 16
+
+// Remaps rgba_rows to palette in horizontal bands, one per thread. Every
+// thread remaps to its own copy of the palette (see remap_to_palette()); a
+// liq_result keeps dithering state, so one can't be shared. Rebuilding the
+// copies is part of the remap in stats.remap_ns.
+static pngquant_error remap_bands(liq_attr *attr, const liq_palette *palette, double gamma, float dithering, unsigned char **rgba_rows,
+                                  unsigned int width, unsigned int height, double image_gamma, unsigned char **row_pointers, int threads)
+{
+  pngquant_error retval = SUCCESS;
+
+  #pragma omp parallel num_threads(threads)
+  {
+    const unsigned int bands = omp_get_num_threads(), band = omp_get_thread_num();
+    const unsigned int start = (uint64_t)height * band / bands, end = (uint64_t)height * (band + 1) / bands;
+    const unsigned int seam = band && dithering > 0 ? (start < REMAP_SEAM_ROWS ? start : REMAP_SEAM_ROWS) : 0;
+    pngquant_error band_retval = OUT_OF_MEMORY_ERROR;
+
+    liq_result *result = palette_result(attr, palette, gamma);
+    unsigned char **rows = malloc((seam + end - start) * sizeof(unsigned char *));
+    unsigned char *scratch = seam ? malloc((size_t)seam * width) : NULL;
+    liq_image *image = NULL;
+    if (result && rows && (scratch || !seam) && end > start) {
+      image = liq_image_create_rgba_rows(attr, (void**)(rgba_rows + start - seam), width, seam + end - start, image_gamma);
+    }
+
+    if (image) {
+      unsigned char lut[256];
+      int identity = palette_lut(liq_get_palette(result), palette, lut);
+      unsigned int row;
+      for(row = 0; row < seam; row++) {
+        rows[row] = scratch + (size_t)row * width;
+      }
+      for(row = start; row < end; row++) {
+        rows[seam + row - start] = row_pointers[row];
+      }
+
+      liq_set_dithering_level(result, dithering);
+      if (liq_write_remapped_image_rows(result, image, rows) == LIQ_OK) {
+        if (!identity) {
+          apply_lut(lut, rows + seam, width, end - start);
+        }
+        band_retval = SUCCESS;
+      }
+    } else if (end <= start) {
+      band_retval = SUCCESS;
+    }
+
+    if (image) liq_image_destroy(image);
+    if (result) liq_result_destroy(result);
+    free(scratch);
+    free(rows);
+    if (band_retval != SUCCESS) {
+      #pragma omp critical
+      retval = band_retval;
+    }
+  }
+
+  return retval;
+}
+
+// Options.dithering as libimagequant's dithering level.
+static float dithering_level(const luaquant_options *options)
+{
+  if (options->dithering == LUAQUANT_DITHER_NONE) {
+    return 0;
+  }
+  return options->dithering > 0 && options->dithering < 100 ? options->dithering / 100.0f : 1.0f;
+}
+
+// Quality of a palette after remapping an image to it. Dithered remaps don't
+// measure their error, so the palette's own estimate stands in for it.
+static void remap_quality(const liq_result *remap, int *quality, double *mse)
+{
+  *mse = liq_get_remapping_error(remap);
+  if (*mse >= 0) {
+    *quality = liq_get_remapping_quality(remap);
+  } else {
+    *mse = liq_get_quantization_error(remap);
+    *quality = *mse >= 0 ? liq_get_quantization_quality(remap) : -1;
+  }
+}
+
+// Past a few million pixels the palette hardly changes, so the histogram of
+// a bigger image is built from a sample of LUAQUANT_SAMPLE_PIXELS, and
+// quantization takes the same time whatever the size. Every pixel is still
+// remapped.
+// Cell size for sampling a width x height image down to options.sample_pixels.
+// Returns 0 if every pixel goes into the histogram.
+static int sample_steps(const luaquant_options *options, unsigned int width, unsigned int height, unsigned int *step_x, unsigned int *step_y)
+{
+  const uint64_t pixels = (uint64_t)width * height;
+  const uint64_t target = options->sample_pixels > 0 ? (uint64_t)options->sample_pixels : LUAQUANT_SAMPLE_PIXELS;
+  if (options->sample_pixels == LUAQUANT_SAMPLE_ALL || pixels <= target) {
+    return 0;
+  }
+
+  const double ratio = (double)pixels / target;
+  *step_y = (unsigned int)sqrt(ratio);
+  if (*step_y < 1) *step_y = 1;
+  if (*step_y > height) *step_y = height;
+  *step_x = (unsigned int)ceil(ratio / *step_y);
+  if (*step_x > width) *step_x = width;
+  return 1;
+}
+
+static inline uint32_t cell_hash(uint32_t a, uint32_t b)
+{
+  uint32_t h = a * 0x9E3779B1u ^ (b + 0x7F4A7C15u) * 0x85EBCA77u;
+  h ^= h >> 15;
+  h *= 0x2C1B3C6Du;
+  return h ^ h >> 12;
+}
+
+// Adds a stratified sample of rows first_row.. (of an image height rows tall)
+// to histogram: the image is cut into step_x x step_y cells, and one pixel of
+// each cell, at a position hashed from the cell's coordinates, goes into the
+// sample. A fixed position would alias with patterns of the same period.
+// Cells are never split between calls, so blocks give the same sample as the
+// whole image.
+static liq_error histogram_add_sample(liq_histogram *histogram, liq_attr *attr, unsigned char **rows, unsigned int width, unsigned int height,
+                                      unsigned int first_row, unsigned int num_rows, unsigned int step_x, unsigned int step_y, double gamma)
+{
+  const unsigned int cols = (width + step_x - 1) / step_x;
+  unsigned char *sample = malloc((size_t)cols * (num_rows / step_y + 2) * 4);
+  unsigned int sample_rows = 0, cx, cy;
+  if (!sample) {
+    return LIQ_OUT_OF_MEMORY;
+  }
+
+  for(cy = first_row / step_y; cy * step_y < first_row + num_rows && cy * step_y < height; cy++) {
+    const unsigned int band = height - cy * step_y < step_y ? height - cy * step_y : step_y;
+    const unsigned int y = cy * step_y + cell_hash(cy, 0) % band;
+    if (y < first_row || y >= first_row + num_rows) {
+      continue;
+    }
+    const unsigned char *row = rows[y - first_row];
+    unsigned char *out = sample + (size_t)sample_rows * cols * 4;
+    for(cx = 0; cx < cols; cx++) {
+      const unsigned int cell = width - cx * step_x < step_x ? width - cx * step_x : step_x;
+      const unsigned int x = cx * step_x + cell_hash(cx, cy + 1) % cell;
+      memcpy(out + cx * 4, row + (size_t)x * 4, 4);
+    }
+    sample_rows++;
+  }
+
+  liq_error err = LIQ_OK;
+  if (sample_rows) {
+    liq_image *image = liq_image_create_rgba(attr, sample, cols, sample_rows, gamma);
+    err = image ? liq_histogram_add_image(histogram, attr, image) : LIQ_OUT_OF_MEMORY;
+    if (image) liq_image_destroy(image);
+  }
+  free(sample);
+  return err;
+}
+
+// Adds rows first_row.. of a width x height image to histogram, sampled if
+// the image is big enough. image, if not NULL, already wraps exactly these rows.
+static liq_error histogram_add_rows(liq_histogram *histogram, liq_attr *attr, const luaquant_options *options, liq_image *image,
+                                    unsigned char **rows, unsigned int width, unsigned int height,
+                                    unsigned int first_row, unsigned int num_rows, double gamma)
+{
+  unsigned int step_x, step_y;
+  if (sample_steps(options, width, height, &step_x, &step_y)) {
+    return histogram_add_sample(histogram, attr, rows, width, height, first_row, num_rows, step_x, step_y, gamma);
+  }
+  if (image) {
+    return liq_histogram_add_image(histogram, attr, image);
+  }
+  image = liq_image_create_rgba_rows(attr, (void**)rows, width, num_rows, gamma);
+  liq_error err = image ? liq_histogram_add_image(histogram, attr, image) : LIQ_OUT_OF_MEMORY;
+  if (image) liq_image_destroy(image);
+  return err;
+}
+
+struct luaquant_context {
+  liq_attr *attr;
+  luaquant_options options;
+  luaquant_arena *arena;
+  rwpng_allocator allocator;
+  png24_image input_image;
+  png8_image output_image;
+  unsigned char *resize_data; // the other half of input_image.rgba_data when resizing
+  png_size_t resize_data_capacity;
+  unsigned char *file_data;   // compressed input read by context_convert_file()
+  png_size_t file_data_capacity;
+  pngquant_error error;       // of the last conversion
+  int quality;                // achieved by the conversion in progress
+  double mse;
+  luaquant_stats stats; // of the conversion in progress
+  uint64_t lap_ns;
+  uint64_t start_ns;    // of the conversion in progress, when stats or a time budget need it
+};
+
+// Process-wide totals of every conversion made with options.stats set.
+static luaquant_stats totals;
+
+static uint64_t clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Charges the time since the previous lap to one stage. Costs nothing when
+// the context doesn't collect stats.
+static void lap(luaquant_context *context, uint64_t *stage_ns)
+{
+  if (context->options.stats) {
+    uint64_t now = clock_ns();
+    *stage_ns += now - context->lap_ns;
+    context->lap_ns = now;
+  }
+}
+
+// Rough single-core deflate speeds on indexed photos, in pixels per ms, best level first.
+static const struct { int level; double pixels_per_ms; } auto_levels[] = {{9, 10000}, {6, 30000}, {1, 100000}};
+
+// LUAQUANT_COMPRESSION_AUTO: with a time budget, the best level that should
+// still finish in time. Without one, small images are assumed to be assets
+// that get cached and served many times, so they're worth the CPU of the best
+// level, while big ones are mostly served once and get fast deflate.
+static int auto_compression_level(const luaquant_context *context, const png8_image *output)
+{
+  double pixels = (double)output->width * output->height;
+  int threads = output->deflate_threads > 1 ? output->deflate_threads : 1;
+  unsigned int i;
+
+  if (context->options.time_budget_ms > 0) {
+    double remaining_ms = context->options.time_budget_ms - (clock_ns() - context->start_ns) / 1e6;
+    for(i = 0; i < sizeof(auto_levels) / sizeof(auto_levels[0]); i++) {
+      if (pixels / (auto_levels[i].pixels_per_ms * threads) <= remaining_ms) {
+        return auto_levels[i].level;
+      }
+    }
+    return 1;
+  }
+
+  if (pixels <= 1024 * 1024) {
+    return 9;
+  }
+  return pixels <= 8 * 1024 * 1024 ? 6 : 1;
+}
+
+// Copies the context's encoder settings onto an image about to be written.
+static void apply_encode_policy(const luaquant_context *context, png8_image *output)
+{
+  const luaquant_options *options = &context->options;
+
+  // inside convert_batch() the cores are already busy with other images
+  output->deflate_threads = options->encode_threads ? options->encode_threads :
+                            omp_in_parallel() ? 1 : omp_get_max_threads();
+  output->compression_level = options->compression_level == LUAQUANT_COMPRESSION_AUTO ?
+                              auto_compression_level(context, output) : options->compression_level;
+  output->compression_strategy = options->compression_strategy;
+  output->compression_mem_level = options->compression_mem_level;
+  output->row_filters = options->row_filters;
+  output->maximum_file_size = options->max_size;
+}
+
+// Index order only matters to deflate when rows are filtered.
+static int filters_rows(const luaquant_options *options)
+{
+  return options->row_filters && options->row_filters != PNG_FILTER_NONE;
+}
+
+// Decodes, remaps and encodes options.stream_rows rows at a time, so only a
+// block of the image is ever held uncompressed. The palette comes from a first
+// pass that feeds every block into a histogram; the second pass decodes the
+// input again and remaps and encodes each block as soon as it's decoded.
+// Dithering restarts at each block, so very small blocks can show seams.
+// Images with at most 256 colors are found during the first pass and written
+// losslessly, like in convert_image().
+static pngquant_error convert_image_streaming(luaquant_context *context, const char *bitmap, size_t len, luaquant_result **result_p)
+{
+  png24_image *input = &context->input_image;
+  png8_image *output = &context->output_image;
+  unsigned int block_rows = context->options.stream_rows;
+  rwpng_row_reader reader;
+  rwpng_row_writer writer;
+  liq_histogram *histogram = NULL;
+  liq_result *remap = NULL;
+  luaquant_exact *exact = NULL;
+  liq_palette palette;
+  unsigned char lut[256];
+  unsigned int row, rows;
+
+  pngquant_error retval = rwpng_read_rows_begin(&reader, (const unsigned char *)bitmap, len, input, 0);
+  if (retval != SUCCESS) {
+    return retval;
+  }
+  if (block_rows > input->height) {
+    block_rows = input->height;
+  }
+
+  if (!reserve_buffer(&input->rgba_data, &input->rgba_data_capacity, (size_t)input->width * 4 * block_rows) ||
+      !reserve_rows(&input->row_pointers, &input->row_pointers_capacity, block_rows) ||
+      !reserve_buffer(&output->indexed_data, &output->indexed_data_capacity, (size_t)input->width * block_rows) ||
+      !reserve_rows(&output->row_pointers, &output->row_pointers_capacity, block_rows)) {
+    rwpng_read_rows_abort(&reader);
+    return OUT_OF_MEMORY_ERROR;
+  }
+  set_row_pointers(input->row_pointers, input->rgba_data, block_rows, (size_t)input->width * 4);
+  set_row_pointers(output->row_pointers, output->indexed_data, block_rows, input->width);
+
+  // pass 1: histogram of the whole image, one block at a time, and its
+  // distinct colors for as long as there are at most 256
+  histogram = liq_histogram_create(context->attr);
+  exact = new_exact();
+  if (!histogram) {
+    retval = OUT_OF_MEMORY_ERROR;
+  }
+  for(row = 0; retval == SUCCESS && row < input->height; row += rows) {
+    rows = input->height - row < block_rows ? input->height - row : block_rows;
+    retval = rwpng_read_rows(&reader, input, input->row_pointers, rows);
+    lap(context, &context->stats.decode_ns);
+    if (retval != SUCCESS) {
+      break;
+    }
+
+    if (exact && !exact_add_rows(exact, input->row_pointers, input->width, rows, NULL)) {
+      free_exact(exact);
+      exact = NULL;
+    }
+    if (histogram_add_rows(histogram, context->attr, &context->options, NULL, input->row_pointers,
+                           input->width, input->height, row, rows, input->gamma) != LIQ_OK) {
+      retval = OUT_OF_MEMORY_ERROR;
+    }
+    lap(context, &context->stats.quantize_ns);
+  }
+  if (retval == SUCCESS) {
+    retval = rwpng_read_rows_end(&reader, input);
+  } else {
+    rwpng_read_rows_abort(&reader);
+  }
+
+  context->quality = 100;
+  context->mse = 0;
+  if (retval == SUCCESS && exact) {
+    exact_get_palette(exact, &palette);
+  } else if (retval == SUCCESS) {
+    liq_error err = liq_histogram_quantize(histogram, context->attr, &remap);
+    if (err != LIQ_OK) {
+      retval = err == LIQ_QUALITY_TOO_LOW ? TOO_LOW_QUALITY : OUT_OF_MEMORY_ERROR;
+    } else {
+      liq_set_dithering_level(remap, dithering_level(&context->options));
+      // blocks are remapped one at a time, so this is the palette's estimate for the whole image
+      context->mse = liq_get_quantization_error(remap);
+      context->quality = context->mse >= 0 ? liq_get_quantization_quality(remap) : -1;
+    }
+  }
+  if (histogram) liq_histogram_destroy(histogram);
+  lap(context, &context->stats.quantize_ns);
+  context->stats.exact_palettes = exact != NULL;
+  if (retval != SUCCESS) {
+    free_exact(exact);
+    return retval;
+  }
+
+  // pass 2: decode again, remap and encode block by block
+  output->width = input->width;
+  output->height = input->height;
+  if (exact) {
+    output->gamma = input->gamma;
+    set_palette_colors(&palette, output);
+  } else {
+    output->gamma = liq_get_output_gamma(remap);
+    set_palette(remap, output);
+  }
+  // unused entries aren't known until the end, but the rest of the cleanup only needs the palette
+  const int translate = order_palette(output, lut);
+  output->chunks = input->chunks; input->chunks = NULL;
+  apply_encode_policy(context, output);
+
+  // the chunks before IDAT are already in output->chunks; skip them this time
+  const int chunk_policy = input->chunk_policy;
+  const char *keep_chunks = input->keep_chunks;
+  input->chunk_policy = RWPNG_CHUNKS_NONE;
+  input->keep_chunks = NULL;
+  retval = rwpng_read_rows_begin(&reader, (const unsigned char *)bitmap, len, input, 0);
+  input->chunk_policy = chunk_policy;
+  input->keep_chunks = keep_chunks;
+  if (retval == SUCCESS) {
+    retval = rwpng_write_rows_begin(&writer, output);
+    if (retval != SUCCESS) {
+      rwpng_read_rows_abort(&reader);
+    }
+  }
+  if (retval != SUCCESS) {
+    if (remap) liq_result_destroy(remap);
+    free_exact(exact);
+    return retval;
+  }
+
+  for(row = 0; retval == SUCCESS && row < input->height; row += rows) {
+    rows = input->height - row < block_rows ? input->height - row : block_rows;
+    retval = rwpng_read_rows(&reader, input, input->row_pointers, rows);
+    lap(context, &context->stats.decode_ns);
+    if (retval != SUCCESS) {
+      rwpng_write_rows_abort(&writer);
+      break;
+    }
+
+    if (exact) {
+      exact_write_rows(exact, input->row_pointers, input->width, rows, output->row_pointers);
+    } else {
+      liq_image *block = liq_image_create_rgba_rows(context->attr, (void**)input->row_pointers, input->width, rows, input->gamma);
+      if (!block) {
+        retval = OUT_OF_MEMORY_ERROR;
+        rwpng_read_rows_abort(&reader);
+        rwpng_write_rows_abort(&writer);
+        break;
+      }
+      liq_error err = liq_write_remapped_image_rows(remap, block, output->row_pointers);
+      liq_image_destroy(block);
+      if (err != LIQ_OK) {
+        retval = OUT_OF_MEMORY_ERROR;
+        rwpng_read_rows_abort(&reader);
+        rwpng_write_rows_abort(&writer);
+        break;
+      }
+    }
+    if (translate) {
+      apply_lut(lut, output->row_pointers, input->width, rows);
+    }
+    lap(context, &context->stats.remap_ns);
+
+    retval = rwpng_write_rows(&writer, output, output->row_pointers, rows);
+    lap(context, &context->stats.encode_ns);
+    if (retval != SUCCESS) {
+      rwpng_read_rows_abort(&reader);
+    }
+  }
+  if (remap) liq_result_destroy(remap);
+  free_exact(exact);
+
+  unsigned char *data = NULL;
+  png_size_t size = 0;
+  if (retval == SUCCESS) {
+    // chunks after IDAT were already collected in pass 1
+    rwpng_read_rows_abort(&reader);
+    retval = rwpng_write_rows_end(&writer, output, &data, &size);
+    lap(context, &context->stats.encode_ns);
+  }
+  if (retval == SUCCESS) {
+    *result_p = calloc(1, sizeof(luaquant_result));
+    if (!*result_p) {
+      free(data);
+      return OUT_OF_MEMORY_ERROR;
+    }
+    (*result_p)->data = (char *)data;
+    (*result_p)->size = size;
+  }
+  return retval;
+}
+
+// Quantizes context->input_image (decoded, or wrapping the caller's pixels)
+// into context->output_image's indices and palette: resize, then the lossless
+// path, the palette cache, or libimagequant, then remap.
+static pngquant_error quantize_image(luaquant_context *context)
+{
+  liq_attr *attr = context->attr;
+  png24_image *input_image_rwpng = &context->input_image;
+  png8_image *output_image = &context->output_image;
+  liq_image *input_image = NULL;
+  liq_result *remap = NULL;
+  pngquant_error retval = SUCCESS;
+
+  if (context->options.resize_width > 0 || context->options.resize_height > 0) {
+    retval = resize_image(&context->options, input_image_rwpng, &context->resize_data, &context->resize_data_capacity);
+    lap(context, &context->stats.resize_ns);
+  }
+  if (retval == SUCCESS) {
+    input_image = liq_image_create_rgba_rows(attr, (void**)input_image_rwpng->row_pointers, input_image_rwpng->width, input_image_rwpng->height, input_image_rwpng->gamma);
+    if (!input_image) {
+      retval = OUT_OF_MEMORY_ERROR;
+    }
+  }
+
+  // images with at most 256 colors are written out losslessly as they are,
+  // without going through libimagequant at all
+  int exact = 0;
+  if (retval == SUCCESS) {
+    liq_palette palette;
+    output_image->width = input_image_rwpng->width;
+    output_image->height = input_image_rwpng->height;
+    output_image->gamma = input_image_rwpng->gamma;
+    if (reserve_buffer(&output_image->indexed_data, &output_image->indexed_data_capacity, (size_t)output_image->height * output_image->width) &&
+        reserve_rows(&output_image->row_pointers, &output_image->row_pointers_capacity, output_image->height)) {
+      set_row_pointers(output_image->row_pointers, output_image->indexed_data, output_image->height, output_image->width);
+      exact = exact_palette(input_image_rwpng, output_image, &palette);
+      if (exact) {
+        set_palette_colors(&palette, output_image);
+      }
+    }
+  }
+  context->stats.exact_palettes = exact;
+
+  // a palette cached for the same pixels and settings skips quantization
+  uint64_t fingerprint = 0;
+  int cached = 0, cached_quality = -1;
+  double cached_mse = -1;
+  unsigned int step_x = 0, step_y = 0;
+  const int sampled = sample_steps(&context->options, input_image_rwpng->width, input_image_rwpng->height, &step_x, &step_y);
+  if (retval == SUCCESS && !exact && palette_cache_enabled()) {
+    liq_palette palette;
+    // palettes made from a sample only serve contexts that sample the same way
+    fingerprint = image_fingerprint(attr, input_image_rwpng, step_x, step_y);
+    if (palette_cache_get(fingerprint, &palette, &cached_quality, &cached_mse)) {
+      remap = palette_result(attr, &palette, input_image_rwpng->gamma);
+      cached = remap != NULL;
+    }
+  }
+
+  // with quality_min, libimagequant gives up as soon as it knows the palette
+  // won't do, and nothing gets remapped or encoded
+  if (retval == SUCCESS && !exact && !remap) {
+    liq_error err;
+    if (sampled) {
+      liq_histogram *histogram = liq_histogram_create(attr);
+      err = histogram ? histogram_add_sample(histogram, attr, input_image_rwpng->row_pointers, input_image_rwpng->width, input_image_rwpng->height,
+                                             0, input_image_rwpng->height, step_x, step_y, input_image_rwpng->gamma) : LIQ_OUT_OF_MEMORY;
+      if (err == LIQ_OK) {
+        err = liq_histogram_quantize(histogram, attr, &remap);
+      }
+      if (histogram) liq_histogram_destroy(histogram);
+    } else {
+      err = liq_image_quantize(input_image, attr, &remap);
+    }
+    if (err != LIQ_OK) {
+      remap = NULL;
+      retval = err == LIQ_QUALITY_TOO_LOW ? TOO_LOW_QUALITY : OUT_OF_MEMORY_ERROR;
+    }
+  }
+  context->stats.cache_hits = cached;
+  lap(context, &context->stats.quantize_ns);
+
+  if (retval == SUCCESS && !exact) {
+    retval = prepare_output_image(remap, input_image, output_image);
+  }
+  context->quality = 100;
+  context->mse = 0;
+  if (retval == SUCCESS && !exact) {
+    const float dithering = dithering_level(&context->options);
+    // inside convert_batch() the cores are already busy with other images
+    int threads = context->options.remap_threads ? context->options.remap_threads :
+                  omp_in_parallel() ? 1 : omp_get_max_threads();
+    if ((uint64_t)output_image->width * output_image->height < REMAP_BAND_MIN_PIXELS) {
+      threads = 1;
+    }
+
+    if (threads > 1) {
+      liq_palette palette = *liq_get_palette(remap);
+      retval = remap_bands(attr, &palette, liq_get_output_gamma(remap), dithering, input_image_rwpng->row_pointers,
+                           output_image->width, output_image->height, input_image_rwpng->gamma, output_image->row_pointers, threads);
+      set_palette_colors(&palette, output_image);
+    } else {
+      liq_set_dithering_level(remap, dithering);
+      liq_write_remapped_image_rows(remap, input_image, output_image->row_pointers);
+      set_palette(remap, output_image);
+    }
+    if (cached) {
+      // the rebuilt result only knows its palette's error against itself
+      context->quality = cached_quality;
+      context->mse = cached_mse;
+    } else {
+      remap_quality(remap, &context->quality, &context->mse);
+    }
+
+    if (fingerprint && !cached) {
+      palette_cache_put(fingerprint, liq_get_palette(remap), context->quality, context->mse);
+    }
+  }
+  if (retval == SUCCESS) {
+    optimize_palette(output_image, filters_rows(&context->options));
+  }
+  lap(context, &context->stats.remap_ns);
+
+  if (input_image) liq_image_destroy(input_image);
+  if (remap) liq_result_destroy(remap);
+  return retval;
+}
+
+// Runs one image through decode -> quantize -> remap -> encode.
+// The context's buffers may hold data from an earlier call; they're reused
+// rather than freed, so the caller decides their lifetime.
+static pngquant_error convert_image(luaquant_context *context, const char *bitmap, size_t len, luaquant_result **result_p)
+{
+  png24_image *input_image_rwpng = &context->input_image;
+  png8_image *output_image = &context->output_image;
+
+  const int resizing = context->options.resize_width > 0 || context->options.resize_height > 0;
+  if (context->options.stream_rows > 0 && !resizing) {
+    pngquant_error retval = convert_image_streaming(context, bitmap, len, result_p);
+    // interlaced images can't be streamed, they take the normal path
+    if (retval != INVALID_ARGUMENT) {
+      return retval;
+    }
+  }
+
+  pngquant_error retval = rwpng_read_image24((const unsigned char *)bitmap, len, input_image_rwpng, 0);
+  lap(context, &context->stats.decode_ns);
+  if (retval == SUCCESS) {
+    retval = quantize_image(context);
+  }
+  if (retval == SUCCESS) {
+    output_image->chunks = input_image_rwpng->chunks; input_image_rwpng->chunks = NULL;
+    apply_encode_policy(context, output_image);
+
+    retval = encode_image(output_image, result_p);
+    lap(context, &context->stats.encode_ns);
+  }
+  return retval;
+}
+
+// Bytes between the rows of the caller's RGBA pixels; 0 means packed rows.
+// In size_t, since width * 4 and stride * height overflow int on big images.
+static size_t rgba_stride(int width, int stride)
+{
+  return stride ? (size_t)stride : (size_t)width * 4;
+}
+
+// Points the context's input image at the caller's RGBA pixels, without copying them.
+static pngquant_error wrap_rgba(luaquant_context *context, const unsigned char *rgba, int width, int height, int stride, double gamma)
+{
+  png24_image *input = &context->input_image;
+
+  if (!rgba || width <= 0 || height <= 0 || stride < 0 || rgba_stride(width, stride) < (size_t)width * 4) {
+    return INVALID_ARGUMENT;
+  }
+  if (input->max_pixels && (size_t)width > input->max_pixels / height) {
+    return TOO_MANY_PIXELS;
+  }
+  if (!reserve_rows(&input->row_pointers, &input->row_pointers_capacity, height)) {
+    return OUT_OF_MEMORY_ERROR;
+  }
+  // liq_image and the lossless pass only ever read through the rows
+  set_row_pointers(input->row_pointers, (unsigned char *)rgba, height, rgba_stride(width, stride));
+  input->width = width;
+  input->height = height;
+  input->gamma = gamma > 0 ? gamma : 0.45455;
+  return SUCCESS;
+}
+
+// Hands the context's quantized image over as a luaquant_indexed. The index
+// buffer moves to the result instead of being copied; the context allocates a
+// new one for its next image.
+static luaquant_indexed* take_indexed(luaquant_context *context)
+{
+  png8_image *output = &context->output_image;
+  luaquant_indexed *indexed = calloc(1, sizeof(luaquant_indexed));
+  if (!indexed) {
+    return NULL;
+  }
+
+  indexed->pixels = output->indexed_data;
+  indexed->width = output->width;
+  indexed->height = output->height;
+  indexed->gamma = output->gamma;
+  indexed->quality = context->quality;
+  indexed->mse = context->mse;
+  indexed->palette_count = output->num_palette;
+  unsigned int i;
+  for(i = 0; i < output->num_palette; i++) {
+    indexed->palette[i][0] = output->palette[i].red;
+    indexed->palette[i][1] = output->palette[i].green;
+    indexed->palette[i][2] = output->palette[i].blue;
+    indexed->palette[i][3] = output->trans[i];
+  }
+
+  output->indexed_data = NULL;
+  output->indexed_data_capacity = 0;
+  return indexed;
+}
+
 // Use this function to compress PNG data using imagequant
 // Usage:
 //
 // q = require "imagequant"
 // f = io.open("original.png", "rb")
-// original = f.read("*all")
+// original = f:read("*all")
 // compressed = q.convert(original, speed)
 //
 // speed is a value from 1 to 10. 1 = higher compression but slower.
 // If you are unsure what to set, set 10. File size is a little bigger,
 // but it runs a lot faster.
-luaquant_result* convert(char* bitmap, int len_, int speed) {
-  liq_attr *attr = liq_attr_create();
-  liq_set_speed(attr, speed);
-  pngquant_error retval = SUCCESS;
-  liq_image *input_image = NULL;
-  png24_image input_image_rwpng = {};
-  png8_image output_image = {};
-  size_t len = len_;
-  read_image(attr, bitmap, &input_image_rwpng, &input_image, &len);
-  liq_result *remap = liq_quantize_image(attr, input_image);
-  retval = prepare_output_image(remap, input_image, &output_image);
-  // check_error(L, retval, "prepare_output_image");
-  liq_write_remapped_image_rows(remap, input_image, output_image.row_pointers);
-  set_palette(remap, &output_image);
-
-  output_image.chunks = input_image_rwpng.chunks; input_image_rwpng.chunks = NULL;
-  
-  luaquant_result *result = write_image(&output_image);
-
-  liq_attr_destroy(attr);
-  liq_image_destroy(input_image);
-  liq_result_destroy(remap);
-  rwpng_free_image24(&input_image_rwpng);
-  rwpng_free_image8(&output_image);
+//
+// Returns NULL if the image couldn't be decoded or quantized.
+luaquant_result* convert(const char* bitmap, int len, int speed) {
+  // an out of range speed keeps the library default, as it always has, and
+  // it runs on the calling thread only; contexts opt in to more threads
+  luaquant_options options = {
+    .speed = speed >= 1 && speed <= 10 ? speed : 0,
+    .encode_threads = 1,
+    .remap_threads = 1,
+  };
+  luaquant_context *context = new_context(&options);
+  if (!context) {
+    return NULL;
+  }
+
+  luaquant_result *result = context_convert(context, bitmap, len);
+
+  free_context(context);
+  return result;
+}
+
+// Use a context when converting many images with the same settings. It keeps
+// the liq_attr and the pixel buffers alive between calls, so a steady stream
+// of similarly sized images doesn't go back to malloc for every conversion.
+// Usage:
+//
+// q = require "imagequant"
+// ctx = q.new{speed=10, quality_min=0, quality_max=100}
+// compressed = ctx:convert(original)
+//
+// A context must not be used from two threads at once.
+luaquant_context* new_context(const luaquant_options *options) {
+  luaquant_context *context = calloc(1, sizeof(luaquant_context));
+  if (!context) {
+    return NULL;
+  }
+  if (options) {
+    context->options = *options;
+  }
+
+  // libpng and libimagequant allocate from the context's arena while an image
+  // is being converted; the arena is reset after every image
+  context->arena = new_arena();
+  if (!context->arena) {
+    free(context);
+    return NULL;
+  }
+  context->allocator = (rwpng_allocator){context->arena, arena_rwpng_malloc, arena_rwpng_free};
+  context->input_image.allocator = &context->allocator;
+  context->output_image.allocator = &context->allocator;
+  set_decode_options(&context->options, &context->input_image);
+
+  // the attr outlives every image, so it must come from the heap even if
+  // another context's arena is active on this thread
+  luaquant_arena *previous = arena_activate(NULL);
+  context->attr = liq_attr_create_with_allocator(arena_liq_malloc, arena_liq_free);
+  arena_activate(previous);
+  if (!context->attr) {
+    free_context(context);
+    return NULL;
+  }
+
+  liq_error err = LIQ_OK;
+  if (context->options.speed) {
+    err = liq_set_speed(context->attr, context->options.speed);
+  }
+  if (err == LIQ_OK && (context->options.quality_min || context->options.quality_max)) {
+    err = liq_set_quality(context->attr, context->options.quality_min, context->options.quality_max ? context->options.quality_max : 100);
+  }
+  if (err != LIQ_OK || context->options.stream_rows < 0 ||
+      context->options.chunks < LUAQUANT_CHUNKS_UNKNOWN || context->options.chunks > LUAQUANT_CHUNKS_ALL ||
+      context->options.sample_pixels < LUAQUANT_SAMPLE_ALL) {
+    free_context(context);
+    return NULL;
+  }
+
+  return context;
+}
+
+// Fills in the totals of the conversion that just finished, hands them to the
+// result and adds them to the process-wide counters.
+static void record_stats(luaquant_context *context, size_t bytes_in, size_t bytes_out, int ok, luaquant_stats *result_stats)
+{
+  luaquant_stats *stats = &context->stats;
+  stats->images = 1;
+  stats->failures = !ok;
+  stats->total_ns = clock_ns() - context->start_ns;
+  stats->bytes_in = bytes_in;
+  stats->bytes_out = bytes_out;
+  stats->pixels = (uint64_t)context->input_image.width * context->input_image.height;
+  stats->allocated = arena_allocated(context->arena);
+  if (result_stats) {
+    *result_stats = *stats;
+  }
+
+  const uint64_t *from = (const uint64_t *)stats;
+  uint64_t *to = (uint64_t *)&totals;
+  size_t i;
+  for(i = 0; i < sizeof(luaquant_stats) / sizeof(uint64_t); i++) {
+    __atomic_fetch_add(&to[i], from[i], __ATOMIC_RELAXED);
+  }
+}
+
+// Counters summed over every conversion made with options.stats set, on any
+// thread, since the process started or reset_cumulative_stats() was called.
+// Usage:
+//
+// q = require "imagequant"
+// ctx = q.new{speed=10, stats=1}
+// compressed, info = ctx:convert(original)
+// print(info.stats.quantize_ns, q.cumulative_stats().images)
+void cumulative_stats(luaquant_stats *stats)
+{
+  const uint64_t *from = (const uint64_t *)&totals;
+  uint64_t *to = (uint64_t *)stats;
+  size_t i;
+  for(i = 0; i < sizeof(luaquant_stats) / sizeof(uint64_t); i++) {
+    to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+}
+
+void reset_cumulative_stats(void)
+{
+  uint64_t *counters = (uint64_t *)&totals;
+  size_t i;
+  for(i = 0; i < sizeof(luaquant_stats) / sizeof(uint64_t); i++) {
+    __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+  }
+}
+
+// Starts timing and activates the context's arena for one conversion.
+static luaquant_arena* begin_conversion(luaquant_context *context)
+{
+  if (context->options.stats || context->options.time_budget_ms > 0) {
+    context->start_ns = context->lap_ns = clock_ns();
+  }
+  if (context->options.stats) {
+    memset(&context->stats, 0, sizeof(context->stats));
+    context->input_image.width = context->input_image.height = 0;
+  }
+  return arena_activate(context->arena);
+}
+
+// Records the outcome, and stats into *stats when the conversion produced
+// something, then releases everything that belonged to this image only.
+static void end_conversion(luaquant_context *context, luaquant_arena *previous, pngquant_error retval, size_t bytes_in, size_t bytes_out, luaquant_stats *stats)
+{
+  context->error = retval;
+  context->stats.too_low_quality = retval == TOO_LOW_QUALITY;
+  if (context->options.stats) {
+    record_stats(context, bytes_in, bytes_out, retval == SUCCESS, stats);
+  }
+
+  // metadata chunks belong to this image only; the pixel buffers stay for the next one
+  rwpng_free_chunks(context->input_image.chunks, &context->allocator);
+  context->input_image.chunks = NULL;
+  rwpng_free_chunks(context->output_image.chunks, &context->allocator);
+  context->output_image.chunks = NULL;
+
+  arena_activate(previous);
+  arena_reset(context->arena);
+}
+
+// Same as convert(), but with the context's settings and buffers.
+luaquant_result* context_convert(luaquant_context *context, const char *bitmap, int len) {
+  luaquant_arena *previous = begin_conversion(context);
+  luaquant_result *result = NULL;
+
+  pngquant_error retval = len > 0 ? convert_image(context, bitmap, len, &result) : READ_ERROR;
+  if (result) {
+    result->quality = context->quality;
+    result->mse = context->mse;
+  }
+
+  end_conversion(context, previous, retval, len > 0 ? len : 0, result ? result->size : 0, result ? &result->stats : NULL);
+  return result;
+}
+
+// Why the context's last conversion returned NULL, or SUCCESS if it didn't.
+// Usage:
+//
+// compressed = ctx:convert(original)
+// if not compressed then print(ctx:error()) end
+pngquant_error context_error(const luaquant_context *context) {
+  return context->error;
+}
+
+// The options the context was created with.
+const luaquant_options* context_options(const luaquant_context *context) {
+  return &context->options;
+}
+
+// A buffer of at least size bytes that the context keeps for the next file,
+// or NULL when out of memory. Its contents don't survive the next call.
+unsigned char* context_file_buffer(luaquant_context *context, size_t size) {
+  return reserve_buffer(&context->file_data, &context->file_data_capacity, size) ? context->file_data : NULL;
+}
+
+// Quantizes and encodes pixels that are already decoded (from a renderer or
+// another decoder), skipping the PNG decode. rgba is width x height RGBA,
+// stride bytes per row (0 = width * 4); gamma 0 means sRGB. The pixels are
+// only read, and not kept after the call.
+// Usage:
+//
+// q = require "imagequant"
+// ctx = q.new{speed=10}
+// compressed = ctx:convert_rgba(pixels, width, height)
+luaquant_result* context_convert_rgba(luaquant_context *context, const unsigned char *rgba, int width, int height, int stride, double gamma) {
+  luaquant_arena *previous = begin_conversion(context);
+  luaquant_result *result = NULL;
+
+  pngquant_error retval = wrap_rgba(context, rgba, width, height, stride, gamma);
+  if (retval == SUCCESS) {
+    retval = quantize_image(context);
+  }
+  if (retval == SUCCESS) {
+    apply_encode_policy(context, &context->output_image);
+    retval = encode_image(&context->output_image, &result);
+    lap(context, &context->stats.encode_ns);
+  }
+  if (result) {
+    result->quality = context->quality;
+    result->mse = context->mse;
+  }
+
+  size_t bytes_in = retval == INVALID_ARGUMENT ? 0 : rgba_stride(width, stride) * height;
+  end_conversion(context, previous, retval, bytes_in, result ? result->size : 0, result ? &result->stats : NULL);
+  return result;
+}
+
+// Decodes and quantizes a PNG, but returns the palette indices and colors
+// instead of encoding them, for a next stage that works on pixels.
+// Usage:
+//
+// q = require "imagequant"
+// ctx = q.new{speed=10}
+// indexed = ctx:quantize(original)
+// -- indexed.pixels[y * indexed.width + x] indexes indexed.palette
+luaquant_indexed* context_quantize(luaquant_context *context, const char *bitmap, int len) {
+  luaquant_arena *previous = begin_conversion(context);
+  luaquant_indexed *indexed = NULL;
+
+  pngquant_error retval = len > 0 ? rwpng_read_image24((const unsigned char *)bitmap, len, &context->input_image, 0) : READ_ERROR;
+  lap(context, &context->stats.decode_ns);
+  if (retval == SUCCESS) {
+    retval = quantize_image(context);
+  }
+  if (retval == SUCCESS) {
+    indexed = take_indexed(context);
+    if (!indexed) {
+      retval = OUT_OF_MEMORY_ERROR;
+    }
+  }
+
+  end_conversion(context, previous, retval, len > 0 ? len : 0, indexed ? (size_t)indexed->width * indexed->height : 0, indexed ? &indexed->stats : NULL);
+  return indexed;
+}
+
+// Raw pixels in, raw indices out: context_convert_rgba() without the PNG
+// encode, so stages chained in memory never touch a codec.
+luaquant_indexed* context_quantize_rgba(luaquant_context *context, const unsigned char *rgba, int width, int height, int stride, double gamma) {
+  luaquant_arena *previous = begin_conversion(context);
+  luaquant_indexed *indexed = NULL;
+
+  pngquant_error retval = wrap_rgba(context, rgba, width, height, stride, gamma);
+  if (retval == SUCCESS) {
+    retval = quantize_image(context);
+  }
+  if (retval == SUCCESS) {
+    indexed = take_indexed(context);
+    if (!indexed) {
+      retval = OUT_OF_MEMORY_ERROR;
+    }
+  }
+
+  size_t bytes_in = retval == INVALID_ARGUMENT ? 0 : rgba_stride(width, stride) * height;
+  end_conversion(context, previous, retval, bytes_in, indexed ? (size_t)indexed->width * indexed->height : 0, indexed ? &indexed->stats : NULL);
+  return indexed;
+}
+
+// Converts a whole set of images on a pool of threads. Images are handed out
+// one at a time, so a single huge image only ties up the thread working on it
+// while the others keep draining the queue. Each thread gets its own context,
+// so buffers are reused across the images it picks up.
+// Usage:
+//
+// q = require "imagequant"
+// compressed = q.convert_batch({png1, png2, png3}, {speed=10, threads=8})
+//
+// results[i] is the conversion of bitmaps[i], or NULL if it failed.
+// Returns the number of images converted.
+int convert_batch(const char *const *bitmaps, const int *lens, int count, const luaquant_options *options, luaquant_result **results) {
+  int threads = options && options->threads ? options->threads : omp_get_max_threads();
+  int converted = 0;
+  int i;
+
+  for(i = 0; i < count; i++) {
+    results[i] = NULL;
+  }
+
+  #pragma omp parallel num_threads(threads) if (count > 1) reduction(+:converted)
+  {
+    luaquant_context *context = NULL;
+
+    #pragma omp for schedule(dynamic, 1)
+    for(i = 0; i < count; i++) {
+      if (!context) {
+        context = new_context(options);
+      }
+      if (context) {
+        results[i] = context_convert(context, bitmaps[i], lens[i]);
+        converted += results[i] != NULL;
+      }
+    }
+
+    free_context(context);
+  }
+
+  return converted;
+}
+
+// Quantizes a set of images (animation frames, sprite sheets) to one shared
+// palette. Every image is decoded and added to a single histogram, which is
+// quantized once; the images are then remapped and encoded in parallel, each
+// output carrying the same PLTE/tRNS so clients can cache it.
+// Usage:
+//
+// q = require "imagequant"
+// frames = q.convert_shared_palette({frame1, frame2, frame3}, {speed=10})
+//
+// results[i] is the conversion of bitmaps[i], or NULL if that image couldn't
+// be decoded. Returns the number of images converted: 0, with every result
+// NULL, if the shared palette couldn't be built.
+int convert_shared_palette(const char *const *bitmaps, const int *lens, int count, const luaquant_options *options, luaquant_result **results) {
+  int threads = options && options->threads ? options->threads : omp_get_max_threads();
+  int converted = 0;
+  int i;
+
+  for(i = 0; i < count; i++) {
+    results[i] = NULL;
+  }
+  if (count <= 0) {
+    return 0;
+  }
+
+  luaquant_context *context = new_context(options);
+  png24_image *inputs = calloc(count, sizeof(png24_image));
+  liq_image **images = calloc(count, sizeof(liq_image *));
+  liq_histogram *histogram = context ? liq_histogram_create(context->attr) : NULL;
+  liq_result *shared = NULL;
+
+  if (!context || !inputs || !images || !histogram) {
+    goto done;
+  }
+  liq_attr *attr = context->attr;
+  // a time budget covers the whole set
+  context->start_ns = clock_ns();
+
+  #pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+  for(i = 0; i < count; i++) {
+    unsigned char *spare = NULL;
+    png_size_t spare_capacity = 0;
+    if (decode_image(attr, &context->options, bitmaps[i], lens[i], &inputs[i], &images[i], &spare, &spare_capacity) != SUCCESS) {
+      images[i] = NULL;
+    }
+    free(spare);
+  }
+
+  // the histogram isn't thread-safe, but adding to it is cheap next to decoding;
+  // a palette that's missing a frame's colors would be wrong for every frame
+  for(i = 0; i < count; i++) {
+    if (images[i] && histogram_add_rows(histogram, attr, &context->options, images[i], inputs[i].row_pointers,
+                                        inputs[i].width, inputs[i].height, 0, inputs[i].height, inputs[i].gamma) != LIQ_OK) {
+      goto done;
+    }
+  }
+  if (liq_histogram_quantize(histogram, attr, &shared) != LIQ_OK) {
+    goto done;
+  }
+
+  liq_palette palette = *liq_get_palette(shared);
+  double gamma = liq_get_output_gamma(shared);
+
+  #pragma omp parallel for num_threads(threads) schedule(dynamic, 1) reduction(+:converted)
+  for(i = 0; i < count; i++) {
+    if (!images[i]) {
+      continue;
+    }
+
+    png8_image output_image = {};
+    output_image.width = inputs[i].width;
+    output_image.height = inputs[i].height;
+    output_image.gamma = gamma;
+    if (!reserve_buffer(&output_image.indexed_data, &output_image.indexed_data_capacity, (size_t)output_image.width * output_image.height) ||
+        !reserve_rows(&output_image.row_pointers, &output_image.row_pointers_capacity, output_image.height)) {
+      rwpng_free_image8(&output_image);
+      continue;
+    }
+    set_row_pointers(output_image.row_pointers, output_image.indexed_data, output_image.height, output_image.width);
+
+    if (remap_to_palette(attr, &palette, gamma, dithering_level(&context->options), images[i], output_image.row_pointers) == SUCCESS) {
+      set_palette_colors(&palette, &output_image);
+      // ordered from the palette alone, not this image's pixels, so every
+      // output keeps the same PLTE/tRNS
+      unsigned char lut[256];
+      if (order_palette(&output_image, lut)) {
+        apply_lut(lut, output_image.row_pointers, output_image.width, output_image.height);
+      }
+      output_image.chunks = inputs[i].chunks; inputs[i].chunks = NULL;
+      output_image.allocator = inputs[i].allocator;
+      apply_encode_policy(context, &output_image);
+
+      results[i] = write_image(&output_image);
+      converted += results[i] != NULL;
+      if (results[i]) {
+        // per image remaps don't measure their error; this is the shared palette's estimate
+        results[i]->mse = liq_get_quantization_error(shared);
+        results[i]->quality = results[i]->mse >= 0 ? liq_get_quantization_quality(shared) : -1;
+      }
+    }
+    rwpng_free_image8(&output_image);
+  }
+
+done:
+  if (shared) liq_result_destroy(shared);
+  if (histogram) liq_histogram_destroy(histogram);
+  for(i = 0; images && inputs && i < count; i++) {
+    if (images[i]) liq_image_destroy(images[i]);
+    rwpng_free_image24(&inputs[i]);
+  }
+  free(images);
+  free(inputs);
+  free_context(context);
+  return converted;
+}
+
+// A copy of attr with a variant's color count and quality, or NULL if they're out of range.
+static liq_attr* variant_attr(const liq_attr *attr, const luaquant_variant *variant)
+{
+  liq_attr *copy = liq_attr_copy(attr);
+  if (copy && (liq_set_max_colors(copy, variant->max_colors ? variant->max_colors : 256) != LIQ_OK ||
+               liq_set_quality(copy, variant->quality_min, variant->quality_max ? variant->quality_max : 100) != LIQ_OK)) {
+    liq_attr_destroy(copy);
+    copy = NULL;
+  }
+  return copy;
+}
+
+// Quantizes a palette to fewer colors, each weighted by the number of pixels
+// that were remapped to it. Much cheaper than going back to the full
+// histogram, and close to it, since the big palette already follows the image.
+static liq_result* reduce_palette(liq_attr *attr, const liq_palette *palette, const uint64_t *counts, double gamma)
+{
+  liq_histogram_entry entries[256];
+  liq_result *result = NULL;
+  unsigned int i;
+  int n = 0;
+
+  for(i = 0; i < palette->count; i++) {
+    if (counts[i]) {
+      entries[n++] = (liq_histogram_entry){.color = palette->entries[i], .count = counts[i] < UINT32_MAX ? counts[i] : UINT32_MAX};
+    }
+  }
+
+  liq_histogram *histogram = liq_histogram_create(attr);
+  if (histogram && liq_histogram_add_colors(histogram, attr, entries, n, gamma) == LIQ_OK &&
+      liq_histogram_quantize(histogram, attr, &result) != LIQ_OK) {
+    result = NULL;
+  }
+  if (histogram) liq_histogram_destroy(histogram);
   return result;
 }
+
+// Converts one image to several palette sizes or qualities at once, e.g. 256,
+// 64 and 16 colors. The image is decoded and its histogram built only once.
+// The variant with the most colors is quantized from the histogram; variants
+// with fewer colors and no minimum quality are reduced from its palette,
+// weighted by how many pixels use each color. If the image has few enough
+// colors for a variant, that variant is lossless. The variants are then
+// remapped and encoded in parallel.
+// Usage:
+//
+// q = require "imagequant"
+// tiers = q.convert_variants(original, {{max_colors=256}, {max_colors=64}, {max_colors=16}}, {speed=10})
+//
+// results[i] is variants[i], or NULL if it failed (e.g. quality_min wasn't
+// reached). Returns the number of variants converted.
+int convert_variants(const char *bitmap, int len, const luaquant_variant *variants, int count, const luaquant_options *options, luaquant_result **results) {
+  int threads = options && options->threads ? options->threads : omp_get_max_threads();
+  int converted = 0;
+  int i;
+
+  for(i = 0; i < count; i++) {
+    results[i] = NULL;
+  }
+  if (count <= 0 || len <= 0) {
+    return 0;
+  }
+
+  luaquant_context *context = new_context(options);
+  liq_attr **attrs = calloc(count, sizeof(liq_attr *));
+  liq_result **quantized = calloc(count, sizeof(liq_result *));
+  png24_image input = {};
+  liq_image *image = NULL;
+  liq_histogram *histogram = NULL;
+  unsigned char *spare = NULL;
+  png_size_t spare_capacity = 0;
+  png8_image exact_image = {}, base_image = {};
+  liq_palette exact_colors;
+  int exact = 0, base = -1;
+
+  if (!context || !attrs || !quantized) {
+    goto done;
+  }
+  liq_attr *attr = context->attr;
+  // a time budget covers all the variants
+  context->start_ns = clock_ns();
+  if (decode_image(attr, &context->options, bitmap, len, &input, &image, &spare, &spare_capacity) != SUCCESS) {
+    goto done;
+  }
+
+  // the image's own colors serve every variant that has room for all of them
+  exact_image.width = input.width;
+  exact_image.height = input.height;
+  if (reserve_buffer(&exact_image.indexed_data, &exact_image.indexed_data_capacity, (size_t)input.width * input.height) &&
+      reserve_rows(&exact_image.row_pointers, &exact_image.row_pointers_capacity, input.height)) {
+    set_row_pointers(exact_image.row_pointers, exact_image.indexed_data, input.height, input.width);
+    exact = exact_palette(&input, &exact_image, &exact_colors);
+  }
+
+  for(i = 0; i < count; i++) {
+    attrs[i] = variant_attr(attr, &variants[i]);
+    if (!attrs[i] || (exact && exact_colors.count <= (unsigned int)liq_get_max_colors(attrs[i]))) {
+      continue;
+    }
+    if (base < 0 || liq_get_max_colors(attrs[i]) > liq_get_max_colors(attrs[base])) {
+      base = i;
+    }
+  }
+
+  // the biggest palette comes from the full histogram, and its remap tells
+  // how many pixels each of its colors stands for
+  uint64_t counts[256] = {};
+  if (base >= 0) {
+    histogram = liq_histogram_create(attr);
+    if (!histogram || histogram_add_rows(histogram, attr, &context->options, image, input.row_pointers,
+                                         input.width, input.height, 0, input.height, input.gamma) != LIQ_OK) {
+      goto done;
+    }
+    if (liq_histogram_quantize(histogram, attrs[base], &quantized[base]) == LIQ_OK &&
+        liq_set_dithering_level(quantized[base], dithering_level(&context->options)) == LIQ_OK &&
+        prepare_output_image(quantized[base], image, &base_image) == SUCCESS &&
+        liq_write_remapped_image_rows(quantized[base], image, base_image.row_pointers) == LIQ_OK) {
+      unsigned int row, col;
+      for(row = 0; row < base_image.height; row++) {
+        for(col = 0; col < base_image.width; col++) {
+          counts[base_image.row_pointers[row][col]]++;
+        }
+      }
+    } else if (quantized[base]) {
+      liq_result_destroy(quantized[base]);
+      quantized[base] = NULL;
+    }
+  }
+
+  for(i = 0; base >= 0 && i < count; i++) {
+    if (i == base || !attrs[i] || (exact && exact_colors.count <= (unsigned int)liq_get_max_colors(attrs[i]))) {
+      continue;
+    }
+    if (quantized[base] && !variants[i].quality_min &&
+        (unsigned int)liq_get_max_colors(attrs[i]) < liq_get_palette(quantized[base])->count) {
+      quantized[i] = reduce_palette(attrs[i], liq_get_palette(quantized[base]), counts, liq_get_output_gamma(quantized[base]));
+    } else if (liq_histogram_quantize(histogram, attrs[i], &quantized[i]) != LIQ_OK) {
+      quantized[i] = NULL;
+    }
+    if (quantized[i]) {
+      liq_set_dithering_level(quantized[i], dithering_level(&context->options));
+    }
+  }
+
+  #pragma omp parallel for num_threads(threads) if (count > 1) schedule(dynamic, 1) reduction(+:converted)
+  for(i = 0; i < count; i++) {
+    png8_image output_image = {};
+    int own_rows = 0;
+    int quality = 100;
+    double mse = 0;
+
+    if (i == base && quantized[i]) {
+      output_image = base_image;
+      set_palette(quantized[i], &output_image);
+    } else if (quantized[i]) {
+      // a liq_image caches its remapping state, so every thread wraps the pixels in its own
+      liq_image *own = liq_image_create_rgba_rows(attr, (void**)input.row_pointers, input.width, input.height, input.gamma);
+      own_rows = 1;
+      if (!own || prepare_output_image(quantized[i], own, &output_image) != SUCCESS ||
+          liq_write_remapped_image_rows(quantized[i], own, output_image.row_pointers) != LIQ_OK) {
+        if (own) liq_image_destroy(own);
+        rwpng_free_image8(&output_image);
+        continue;
+      }
+      liq_image_destroy(own);
+      set_palette(quantized[i], &output_image);
+    } else if (attrs[i] && exact && exact_colors.count <= (unsigned int)liq_get_max_colors(attrs[i])) {
+      output_image = exact_image;
+      output_image.gamma = input.gamma;
+      set_palette_colors(&exact_colors, &output_image);
+    } else {
+      continue;
+    }
+
+    if (quantized[i]) {
+      remap_quality(quantized[i], &quality, &mse);
+      // the exact variants share their rows, and their palette is already in order
+      optimize_palette(&output_image, filters_rows(&context->options));
+    }
+
+    // every variant writes the same metadata; writing only reads the chunks
+    output_image.chunks = input.chunks;
+    apply_encode_policy(context, &output_image);
+    results[i] = write_image(&output_image);
+    converted += results[i] != NULL;
+    if (results[i]) {
+      results[i]->quality = quality;
+      results[i]->mse = mse;
+    }
+
+    output_image.chunks = NULL;
+    if (own_rows) {
+      rwpng_free_image8(&output_image);
+    }
+  }
+
+done:
+  for(i = 0; attrs && quantized && i < count; i++) {
+    if (quantized[i]) liq_result_destroy(quantized[i]);
+    if (attrs[i]) liq_attr_destroy(attrs[i]);
+  }
+  free(quantized);
+  free(attrs);
+  if (histogram) liq_histogram_destroy(histogram);
+  if (image) liq_image_destroy(image);
+  rwpng_free_image8(&base_image);
+  rwpng_free_image8(&exact_image);
+  rwpng_free_image24(&input);
+  free(spare);
+  free_context(context);
+  return converted;
+}
+
+void free_context(luaquant_context *context) {
+  if (!context) {
+    return;
+  }
+  if (context->attr) liq_attr_destroy(context->attr);
+  rwpng_free_image24(&context->input_image);
+  rwpng_free_image8(&context->output_image);
+  free(context->resize_data);
+  free(context->file_data);
+  free_arena(context->arena);
+  free(context);
+}
+
+void free_indexed(luaquant_indexed *indexed) {
+  if (!indexed) {
+    return;
+  }
+  free(indexed->pixels);
+  free(indexed);
+}
+
+void free_result(luaquant_result *result) {
+  if (!result) {
+    return;
+  }
+  free(result->data);
+  free(result);
+}
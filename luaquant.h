@@ -9,13 +9,209 @@
 #include "rwpng.h"
 #include "imagequant/libimagequant.h"
 
+// Where a conversion spent its time and memory. Times are monotonic-clock
+// nanoseconds; allocated counts the bytes libpng and libimagequant asked for
+// while converting (the context's pixel buffers are not included).
+typedef struct luaquant_stats {
+  uint64_t images;
+  uint64_t failures;
+  uint64_t cache_hits;
+  uint64_t exact_palettes; // images that had <= 256 colors and skipped quantization
+  uint64_t too_low_quality; // images given up on because quality_min couldn't be reached
+  uint64_t decode_ns;
+  uint64_t resize_ns;
+  uint64_t quantize_ns;
+  uint64_t remap_ns;
+  uint64_t encode_ns;
+  uint64_t total_ns;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t pixels;
+  uint64_t allocated;
+} luaquant_stats;
+
 typedef struct luaquant_result {
   char *data;
   size_t size;
+  int quality; // 0-100 achieved by the palette, -1 if libimagequant couldn't tell
+  double mse;  // mean square error behind quality, 0 for lossless output
+  luaquant_stats stats; // only filled in when luaquant_options.stats is set
 } luaquant_result;
 
+// A quantized image without PNG encoding, for stages that pass pixels in memory.
+typedef struct luaquant_indexed {
+  unsigned char *pixels;          // width * height palette indices, rows packed
+  unsigned int width;
+  unsigned int height;
+  double gamma;
+  unsigned int palette_count;
+  unsigned char palette[256][4];  // RGBA
+  int quality;                    // as in luaquant_result
+  double mse;
+  luaquant_stats stats;           // only filled in when luaquant_options.stats is set
+} luaquant_indexed;
+
+// Settings for a luaquant_context. Zeroed fields keep libimagequant's defaults,
+// so callers only need to fill in what they care about.
+typedef struct luaquant_options {
+  int speed;        // 1-10, 1 = slower but better compression
+  int quality_min;  // 0-100, give up (TOO_LOW_QUALITY) before remapping when the palette can't reach it
+  int quality_max;  // 0-100, use fewer colors when this is enough
+  int threads;      // convert_batch() worker threads, 0 = one per core
+  int stream_rows;  // > 0: decode, remap and encode this many rows at a time (for huge images)
+  int stats;        // 1: time each stage into result->stats and cumulative_stats()
+  int encode_threads; // deflate large outputs in bands on this many threads, 0 = one per core, 1 = off
+  int compression_level;    // zlib level 1-9, 0 = 9, LUAQUANT_COMPRESSION_AUTO = by image size and time_budget_ms
+  int compression_strategy; // zlib strategy (Z_FILTERED = 1, Z_RLE = 3, ...), 0 = default
+  int compression_mem_level;// zlib memLevel 1-9, 0 = zlib's default
+  int row_filters;          // PNG_FILTER_* mask, 0 = no filtering
+  int time_budget_ms;       // with LUAQUANT_COMPRESSION_AUTO: deflate faster when the encode wouldn't finish in time
+  size_t max_size;          // give up as soon as the output grows past this many bytes, 0 = no limit
+  int resize_width;  // > 0: scale down after decoding to fit this width, keeping the aspect ratio
+  int resize_height; // > 0: same for the height; resized images don't use stream_rows
+  int resize_filter; // LUAQUANT_RESIZE_BOX or LUAQUANT_RESIZE_LANCZOS
+  int dithering;     // Floyd-Steinberg strength in percent, 0 = full, LUAQUANT_DITHER_NONE = off
+  int remap_threads; // remap and resize large images in bands on this many threads, 0 = one per core, 1 = off
+  int chunks;              // metadata to copy to the output: LUAQUANT_CHUNKS_UNKNOWN, _NONE or _ALL
+  const char *keep_chunks; // if set, copy only the chunks named here, e.g. "iTXt eXIf"; must outlive the context
+  int sample_pixels; // build the palette of larger images from a sample of this many pixels, 0 = 4M, LUAQUANT_SAMPLE_ALL = off
+  size_t max_pixels; // > 0: refuse larger images (TOO_MANY_PIXELS) from their header, before anything is allocated
+  int sync;          // convert_file(): 1 = fsync the output before renaming it over out_path, so it survives a crash
+} luaquant_options;
+
+#define LUAQUANT_COMPRESSION_AUTO -1
+
+#define LUAQUANT_DITHER_NONE -1
+
+#define LUAQUANT_SAMPLE_ALL -1
+#define LUAQUANT_SAMPLE_PIXELS (4 * 1024 * 1024) // sample_pixels = 0
+
+#define LUAQUANT_CHUNKS_UNKNOWN 0 // private chunks libpng doesn't know; text, EXIF, pHYs and tIME are dropped
+#define LUAQUANT_CHUNKS_NONE 1
+#define LUAQUANT_CHUNKS_ALL 2     // every ancillary chunk but the color ones
+
+#define LUAQUANT_RESIZE_BOX 0     // area average: fast, slightly soft
+#define LUAQUANT_RESIZE_LANCZOS 1 // Lanczos-3: sharper, slower on big reductions
+
+// One output of convert_variants(): the image at another palette size or quality.
+typedef struct luaquant_variant {
+  int max_colors;  // 2-256, 0 = 256
+  int quality_min; // 0-100
+  int quality_max; // 0-100, 0 = 100
+} luaquant_variant;
+
+// What probe() found in a PNG's header and chunk list, without decoding it.
+#define LUAQUANT_PROBE_CHUNK_TYPES 32
+
+typedef struct luaquant_chunk_count {
+  char name[5];
+  unsigned int count;
+  size_t bytes; // data only, without the 12 bytes of length, type and CRC
+} luaquant_chunk_count;
+
+typedef struct luaquant_probe {
+  unsigned int width;
+  unsigned int height;
+  int bit_depth;
+  int color_type;  // PNG_COLOR_TYPE_*
+  int interlaced;
+  int complete;    // the chunk list reached IEND; 0 for truncated files
+  unsigned int chunk_types;   // used entries in chunks, in order of first appearance
+  luaquant_chunk_count chunks[LUAQUANT_PROBE_CHUNK_TYPES];
+  size_t idat_bytes;          // compressed pixel data
+  size_t metadata_bytes;      // ancillary chunks
+  // rough cost of converting it with the options given to probe()
+  size_t peak_memory;         // bytes allocated at once
+  uint64_t decode_pixels;     // pixels libpng inflates (streaming decodes twice)
+  uint64_t quantize_pixels;   // pixels that go into the histogram
+  uint64_t remap_pixels;      // pixels remapped and encoded
+} luaquant_probe;
+
+// Long-lived conversion state: the configured liq_attr plus the decode/remap
+// buffers, which are kept between calls and only grown when an image is larger.
+typedef struct luaquant_context luaquant_context;
+
+// Counters for the process-wide palette cache.
+typedef struct luaquant_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t entries;
+  size_t bytes;
+} luaquant_cache_stats;
+
+// Per-context bump allocator for the allocations made while converting one image.
+typedef struct luaquant_arena luaquant_arena;
+
+// Distinct colors of an image being decoded in blocks, while there are at most 256.
+typedef struct luaquant_exact luaquant_exact;
+
+// A conversion queued with convert_async(), running on a background thread.
+typedef struct luaquant_job luaquant_job;
+
 luaquant_result* write_image(png8_image *output_image);
 pngquant_error read_image(liq_attr *options, const char *bitmap, png24_image *input_image_p, liq_image **liq_image_p, size_t *len);
 pngquant_error prepare_output_image(liq_result *result, liq_image *input_image, png8_image *output_image);
 void set_palette(liq_result *result, png8_image *output_image);
-luaquant_result* convert(char* bitmap, int len, int speed);
+void set_palette_colors(const liq_palette *palette, png8_image *output_image);
+luaquant_result* convert(const char* bitmap, int len, int speed);
+luaquant_context* new_context(const luaquant_options *options);
+luaquant_result* context_convert(luaquant_context *context, const char *bitmap, int len);
+pngquant_error context_error(const luaquant_context *context);
+const luaquant_options* context_options(const luaquant_context *context);
+unsigned char* context_file_buffer(luaquant_context *context, size_t size);
+pngquant_error context_convert_file(luaquant_context *context, const char *in_path, const char *out_path);
+pngquant_error convert_file(const char *in_path, const char *out_path, const luaquant_options *options);
+pngquant_error probe(const char *bitmap, int len, const luaquant_options *options, luaquant_probe *info);
+luaquant_result* context_convert_rgba(luaquant_context *context, const unsigned char *rgba, int width, int height, int stride, double gamma);
+luaquant_indexed* context_quantize(luaquant_context *context, const char *bitmap, int len);
+luaquant_indexed* context_quantize_rgba(luaquant_context *context, const unsigned char *rgba, int width, int height, int stride, double gamma);
+void free_context(luaquant_context *context);
+int convert_batch(const char *const *bitmaps, const int *lens, int count, const luaquant_options *options, luaquant_result **results);
+int convert_shared_palette(const char *const *bitmaps, const int *lens, int count, const luaquant_options *options, luaquant_result **results);
+int convert_variants(const char *bitmap, int len, const luaquant_variant *variants, int count, const luaquant_options *options, luaquant_result **results);
+int palette_cache_configure(size_t max_bytes);
+void palette_cache_stats(luaquant_cache_stats *stats);
+void cumulative_stats(luaquant_stats *stats);
+void reset_cumulative_stats(void);
+luaquant_job* convert_async(const char *bitmap, int len, const luaquant_options *options);
+int job_ready(luaquant_job *job);
+luaquant_result* job_wait(luaquant_job *job);
+int async_fd(void);
+void free_job(luaquant_job *job);
+void free_result(luaquant_result *result);
+void free_indexed(luaquant_indexed *indexed);
+
+luaquant_arena* new_arena(void);
+void* arena_malloc(luaquant_arena *arena, size_t size);
+void arena_free(void *ptr);
+void arena_reset(luaquant_arena *arena);
+uint64_t arena_allocated(const luaquant_arena *arena);
+void free_arena(luaquant_arena *arena);
+luaquant_arena* arena_activate(luaquant_arena *arena);
+void* arena_liq_malloc(size_t size);
+void arena_liq_free(void *ptr);
+void* arena_rwpng_malloc(void *arena, png_size_t size);
+void arena_rwpng_free(void *arena, void *ptr);
+
+int palette_cache_enabled(void);
+int palette_cache_get(uint64_t key, liq_palette *palette, int *quality, double *mse);
+void palette_cache_put(uint64_t key, const liq_palette *palette, int quality, double mse);
+uint64_t image_fingerprint(const liq_attr *attr, const png24_image *image, unsigned int step_x, unsigned int step_y);
+
+luaquant_exact* new_exact(void);
+int exact_add_rows(luaquant_exact *exact, unsigned char **rows, unsigned int width, unsigned int height, unsigned char **indices);
+int exact_get_palette(luaquant_exact *exact, liq_palette *palette);
+void exact_write_rows(luaquant_exact *exact, unsigned char **rows, unsigned int width, unsigned int height, unsigned char **indices);
+void free_exact(luaquant_exact *exact);
+int exact_palette(const png24_image *input, png8_image *output, liq_palette *palette);
+
+int resize_rgba(unsigned char **src_rows, unsigned int src_width, unsigned int src_height,
+                unsigned char *dst, unsigned int dst_width, unsigned int dst_height, int filter, int max_threads);
+size_t resize_scratch_bytes(unsigned int src_width, unsigned int src_height, unsigned int dst_width, unsigned int dst_height,
+                            int filter, int threads);
+void resize_fit(unsigned int width, unsigned int height, unsigned int max_width, unsigned int max_height,
+                unsigned int *fit_width, unsigned int *fit_height);
+
+void optimize_palette(png8_image *image, int by_similarity);
+int order_palette(png8_image *image, unsigned char lut[256]);
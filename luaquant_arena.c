@@ -0,0 +1,195 @@
+// Bump allocator for the short-lived allocations made while converting one
+// image (libpng structs and buffers, metadata chunks, libimagequant's internal
+// images and histograms). A context resets its arena after every image, and
+// the arena keeps its memory, so steady-state conversions barely touch malloc.
+//
+// Every allocation carries a small header saying where it came from, so
+// arena_free() is safe to call on anything arena_malloc() returned, on any
+// thread: heap allocations are freed, arena allocations are left for reset.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "rwpng.h"
+#include "imagequant/libimagequant.h"
+#include "luaquant.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_FIRST_BLOCK (64 * 1024)
+// big buffers (whole-image float copies and the like) go straight to the heap,
+// so an arena only ever holds the many small allocations
+#define ARENA_LARGE_ALLOCATION (256 * 1024)
+
+enum { FROM_HEAP = 1, FROM_ARENA = 2 };
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+} arena_block;
+
+#define BLOCK_HEADER ((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct luaquant_arena {
+  arena_block *blocks; // most recent first
+  uint64_t allocated;  // bytes requested since the last reset
+};
+
+// liq_attr_create_with_allocator() takes plain malloc/free, so libimagequant
+// finds the arena of the conversion running on this thread through here
+static __thread luaquant_arena *active_arena;
+
+luaquant_arena* new_arena(void)
+{
+  return calloc(1, sizeof(luaquant_arena));
+}
+
+static arena_block* add_block(luaquant_arena *arena, size_t size)
+{
+  arena_block *block = malloc(BLOCK_HEADER + size);
+  if (!block) {
+    return NULL;
+  }
+  block->size = size;
+  block->used = 0;
+  block->next = arena->blocks;
+  arena->blocks = block;
+  return block;
+}
+
+static void* bump(luaquant_arena *arena, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  arena_block *block = arena->blocks;
+  if (!block || block->size - block->used < size) {
+    size_t block_size = block ? block->size * 2 : ARENA_FIRST_BLOCK;
+    if (block_size < size) {
+      block_size = size;
+    }
+    block = add_block(arena, block_size);
+    if (!block) {
+      return NULL;
+    }
+  }
+
+  void *ptr = (unsigned char *)block + BLOCK_HEADER + block->used;
+  block->used += size;
+  return ptr;
+}
+
+void* arena_malloc(luaquant_arena *arena, size_t size)
+{
+  unsigned char *ptr;
+  size_t origin;
+
+  if (arena && size < ARENA_LARGE_ALLOCATION) {
+    ptr = bump(arena, ARENA_ALIGN + size);
+    origin = FROM_ARENA;
+  } else {
+    ptr = malloc(ARENA_ALIGN + size);
+    origin = FROM_HEAP;
+  }
+  if (!ptr) {
+    return NULL;
+  }
+  if (arena) {
+    arena->allocated += size;
+  }
+
+  memcpy(ptr, &origin, sizeof(origin));
+  return ptr + ARENA_ALIGN;
+}
+
+void arena_free(void *ptr)
+{
+  if (!ptr) {
+    return;
+  }
+
+  unsigned char *base = (unsigned char *)ptr - ARENA_ALIGN;
+  size_t origin;
+  memcpy(&origin, base, sizeof(origin));
+  if (origin == FROM_HEAP) {
+    free(base);
+  }
+}
+
+// Forgets everything allocated since the last reset. If the image needed more
+// than one block, they're merged into one big enough for all of it, so the
+// next image of the same size fits without allocating.
+void arena_reset(luaquant_arena *arena)
+{
+  arena->allocated = 0;
+  arena_block *block = arena->blocks;
+  if (!block) {
+    return;
+  }
+
+  if (!block->next) {
+    block->used = 0;
+    return;
+  }
+
+  size_t total = 0;
+  while (block) {
+    arena_block *next = block->next;
+    total += block->size;
+    free(block);
+    block = next;
+  }
+  arena->blocks = NULL;
+  add_block(arena, total);
+}
+
+uint64_t arena_allocated(const luaquant_arena *arena)
+{
+  return arena->allocated;
+}
+
+void free_arena(luaquant_arena *arena)
+{
+  if (!arena) {
+    return;
+  }
+  arena_block *block = arena->blocks;
+  while (block) {
+    arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  free(arena);
+}
+
+// Makes arena the one libimagequant allocates from on this thread, and
+// returns the previous one so calls can nest.
+luaquant_arena* arena_activate(luaquant_arena *arena)
+{
+  luaquant_arena *previous = active_arena;
+  active_arena = arena;
+  return previous;
+}
+
+void* arena_liq_malloc(size_t size)
+{
+  return arena_malloc(active_arena, size);
+}
+
+void arena_liq_free(void *ptr)
+{
+  arena_free(ptr);
+}
+
+// Adapters for rwpng_allocator, which passes the arena explicitly.
+void* arena_rwpng_malloc(void *arena, png_size_t size)
+{
+  return arena_malloc(arena, size);
+}
+
+void arena_rwpng_free(void *arena, void *ptr)
+{
+  (void)arena; // a block knows its own arena
+  arena_free(ptr);
+}
@@ -0,0 +1,270 @@
+// Background conversion for callers that can't afford to block, such as an
+// nginx/OpenResty worker running its event loop. Jobs are queued to a fixed
+// pool of native threads that is started on first use and lives for the rest
+// of the process.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "rwpng.h"
+#include "imagequant/libimagequant.h"
+#include "luaquant.h"
+
+struct luaquant_job {
+  const char *bitmap; // the job's own copy, stored after the struct
+  int len;
+  luaquant_options options; // keep_chunks points at the job's own copy too
+  luaquant_result *result;
+  int done;
+  int abandoned; // free_job() was called before the job finished
+  struct luaquant_job *next;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t queued;
+  pthread_cond_t finished;
+  luaquant_job *head, *tail;
+  int fd;
+  int started;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, -1, 0};
+
+static void notify_fd(void)
+{
+#ifdef __linux__
+  uint64_t one = 1;
+  if (pool.fd >= 0 && write(pool.fd, &one, sizeof(one)) < 0) {
+    // the counter only overflows if nobody ever reads it, nothing to do
+  }
+#endif
+}
+
+static int same_string(const char *a, const char *b)
+{
+  return a == b || (a && b && !strcmp(a, b));
+}
+
+// Compared field by field: the struct has padding, and keep_chunks is
+// compared by content.
+static int same_options(const luaquant_options *a, const luaquant_options *b)
+{
+  return a->speed == b->speed && a->quality_min == b->quality_min && a->quality_max == b->quality_max &&
+         a->threads == b->threads && a->stream_rows == b->stream_rows && a->stats == b->stats &&
+         a->encode_threads == b->encode_threads && a->compression_level == b->compression_level &&
+         a->compression_strategy == b->compression_strategy && a->compression_mem_level == b->compression_mem_level &&
+         a->row_filters == b->row_filters && a->time_budget_ms == b->time_budget_ms && a->max_size == b->max_size &&
+         a->resize_width == b->resize_width && a->resize_height == b->resize_height && a->resize_filter == b->resize_filter &&
+         a->dithering == b->dithering && a->remap_threads == b->remap_threads && a->chunks == b->chunks &&
+         same_string(a->keep_chunks, b->keep_chunks) && a->sample_pixels == b->sample_pixels && a->max_pixels == b->max_pixels &&
+         a->sync == b->sync;
+}
+
+static void* worker_main(void *unused)
+{
+  (void)unused;
+  // a worker keeps one context and only rebuilds it when a job asks for
+  // different settings. The context outlives the job that made it, so its
+  // options.keep_chunks points at the worker's own copy of the string.
+  luaquant_context *context = NULL;
+  luaquant_options context_options;
+  char *context_keep_chunks = NULL;
+
+  for(;;) {
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.head) {
+      pthread_cond_wait(&pool.queued, &pool.lock);
+    }
+    luaquant_job *job = pool.head;
+    pool.head = job->next;
+    if (!pool.head) {
+      pool.tail = NULL;
+    }
+    int skip = job->abandoned;
+    pthread_mutex_unlock(&pool.lock);
+
+    luaquant_result *result = NULL;
+    if (!skip) {
+      if (context && !same_options(&context_options, &job->options)) {
+        free_context(context);
+        context = NULL;
+      }
+      if (!context) {
+        free(context_keep_chunks);
+        context_options = job->options;
+        context_keep_chunks = job->options.keep_chunks ? strdup(job->options.keep_chunks) : NULL;
+        context_options.keep_chunks = context_keep_chunks;
+        if (!job->options.keep_chunks || context_keep_chunks) {
+          context = new_context(&context_options);
+        }
+      }
+      if (context) {
+        result = context_convert(context, job->bitmap, job->len);
+      }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (job->abandoned) {
+      pthread_mutex_unlock(&pool.lock);
+      free_result(result);
+      free(job);
+      continue;
+    }
+    job->result = result;
+    job->done = 1;
+    pthread_cond_broadcast(&pool.finished);
+    pthread_mutex_unlock(&pool.lock);
+
+    notify_fd();
+  }
+  return NULL;
+}
+
+// Called with pool.lock held.
+static int start_pool(int threads)
+{
+  if (pool.started) {
+    return 1;
+  }
+
+#ifdef __linux__
+  pool.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads <= 0) {
+    threads = 1;
+  }
+
+  int i;
+  for(i = 0; i < threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker_main, NULL) == 0) {
+      pthread_detach(thread);
+      pool.started++;
+    }
+  }
+  return pool.started > 0;
+}
+
+// Queues a conversion and returns immediately. The bitmap (and
+// options->keep_chunks) are copied into the job, so the caller may release
+// them, or free the job, at any time, even while a worker is converting it.
+// Usage:
+//
+// q = require "imagequant"
+// job = q.convert_async(original, {speed=10})
+// while not job:ready() do coroutine.yield() end
+// compressed = job:wait()
+//
+// The pool is sized by options->threads of the first job (0 = one per core).
+luaquant_job* convert_async(const char *bitmap, int len, const luaquant_options *options)
+{
+  // no input at all still makes a job, which fails with READ_ERROR
+  const size_t copy_len = bitmap && len > 0 ? len : 0;
+  const size_t keep_len = options && options->keep_chunks ? strlen(options->keep_chunks) + 1 : 0;
+  luaquant_job *job = calloc(1, sizeof(luaquant_job) + copy_len + keep_len);
+  if (!job) {
+    return NULL;
+  }
+  char *copy = (char *)(job + 1);
+  if (copy_len) {
+    memcpy(copy, bitmap, copy_len);
+  }
+  job->bitmap = copy;
+  job->len = copy_len;
+  if (options) {
+    job->options = *options;
+  }
+  if (keep_len) {
+    memcpy(copy + copy_len, options->keep_chunks, keep_len);
+    job->options.keep_chunks = copy + copy_len;
+  }
+  // the pool already has a thread per core, so don't fan out the resize, remap or encoding too
+  if (!job->options.encode_threads) {
+    job->options.encode_threads = 1;
+  }
+  if (!job->options.remap_threads) {
+    job->options.remap_threads = 1;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  if (!start_pool(job->options.threads)) {
+    pthread_mutex_unlock(&pool.lock);
+    free(job);
+    return NULL;
+  }
+  if (pool.tail) {
+    pool.tail->next = job;
+  } else {
+    pool.head = job;
+  }
+  pool.tail = job;
+  pthread_cond_signal(&pool.queued);
+  pthread_mutex_unlock(&pool.lock);
+
+  return job;
+}
+
+// Non-blocking: 1 once the job has finished (successfully or not).
+int job_ready(luaquant_job *job)
+{
+  pthread_mutex_lock(&pool.lock);
+  int done = job->done;
+  pthread_mutex_unlock(&pool.lock);
+  return done;
+}
+
+// Blocks until the job is done and hands over its result (NULL on failure).
+// Only call this after job_ready() when running inside an event loop.
+luaquant_result* job_wait(luaquant_job *job)
+{
+  pthread_mutex_lock(&pool.lock);
+  while (!job->done) {
+    pthread_cond_wait(&pool.finished, &pool.lock);
+  }
+  luaquant_result *result = job->result;
+  job->result = NULL;
+  pthread_mutex_unlock(&pool.lock);
+  return result;
+}
+
+// An eventfd that becomes readable whenever any job finishes, for registering
+// with an event loop. Read it to reset it, then check job_ready() on pending
+// jobs. -1 where eventfd isn't available.
+int async_fd(void)
+{
+  pthread_mutex_lock(&pool.lock);
+  start_pool(0);
+  int fd = pool.fd;
+  pthread_mutex_unlock(&pool.lock);
+  return fd;
+}
+
+// Safe to call at any time; a job that is still queued or running is
+// discarded by its worker once it gets to it (the job owns its input, so
+// nothing the caller frees is read after this).
+void free_job(luaquant_job *job)
+{
+  if (!job) {
+    return;
+  }
+  pthread_mutex_lock(&pool.lock);
+  if (!job->done) {
+    job->abandoned = 1;
+    pthread_mutex_unlock(&pool.lock);
+    return;
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  free_result(job->result);
+  free(job);
+}
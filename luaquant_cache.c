@@ -0,0 +1,229 @@
+// Process-wide LRU cache of finished palettes, keyed by a fingerprint of the
+// decoded pixels and the quantization settings. Re-converting an image that
+// was seen before (same file re-uploaded, same art re-encoded) then skips
+// liq_quantize_image and only remaps. Off until palette_cache_configure() is
+// given a byte budget.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "rwpng.h"
+#include "imagequant/libimagequant.h"
+#include "luaquant.h"
+
+typedef struct cache_entry {
+  uint64_t key;
+  struct cache_entry *bucket_next;
+  struct cache_entry *newer, *older;
+  size_t bytes;
+  int quality;  // what remapping the image to the palette achieved
+  double mse;
+  unsigned int count;
+  liq_color entries[];
+} cache_entry;
+
+static struct {
+  pthread_mutex_t lock;
+  size_t max_bytes;
+  cache_entry **buckets;
+  size_t bucket_mask;
+  cache_entry *newest, *oldest;
+  luaquant_cache_stats stats;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void unlink_lru(cache_entry *entry)
+{
+  if (entry->newer) entry->newer->older = entry->older; else cache.newest = entry->older;
+  if (entry->older) entry->older->newer = entry->newer; else cache.oldest = entry->newer;
+  entry->newer = entry->older = NULL;
+}
+
+static void push_newest(cache_entry *entry)
+{
+  entry->older = cache.newest;
+  entry->newer = NULL;
+  if (cache.newest) cache.newest->newer = entry; else cache.oldest = entry;
+  cache.newest = entry;
+}
+
+static void remove_entry(cache_entry *entry)
+{
+  cache_entry **slot = &cache.buckets[entry->key & cache.bucket_mask];
+  while (*slot != entry) {
+    slot = &(*slot)->bucket_next;
+  }
+  *slot = entry->bucket_next;
+  unlink_lru(entry);
+  cache.stats.bytes -= entry->bytes;
+  cache.stats.entries--;
+  free(entry);
+}
+
+static void clear_locked(void)
+{
+  while (cache.oldest) {
+    remove_entry(cache.oldest);
+  }
+  free(cache.buckets);
+  cache.buckets = NULL;
+  cache.bucket_mask = 0;
+}
+
+// Sets the cache's memory budget in bytes and empties it. 0 turns it off.
+// Returns 0 if the cache couldn't be allocated (it's left off then).
+int palette_cache_configure(size_t max_bytes)
+{
+  pthread_mutex_lock(&cache.lock);
+  clear_locked();
+  cache.max_bytes = 0;
+
+  if (max_bytes) {
+    // enough buckets for the budget filled with full 256-color palettes
+    size_t entries = max_bytes / (sizeof(cache_entry) + 256 * sizeof(liq_color)) + 1;
+    size_t buckets = 16;
+    while (buckets < entries) {
+      buckets *= 2;
+    }
+    cache.buckets = calloc(buckets, sizeof(cache_entry *));
+    if (cache.buckets) {
+      cache.bucket_mask = buckets - 1;
+      cache.max_bytes = max_bytes;
+    }
+  }
+
+  int enabled = cache.max_bytes > 0;
+  pthread_mutex_unlock(&cache.lock);
+  return enabled;
+}
+
+int palette_cache_enabled(void)
+{
+  pthread_mutex_lock(&cache.lock);
+  int enabled = cache.max_bytes > 0;
+  pthread_mutex_unlock(&cache.lock);
+  return enabled;
+}
+
+// Copies the palette stored under key, with the quality and MSE the image got
+// from it, and counts a hit; counts a miss otherwise.
+int palette_cache_get(uint64_t key, liq_palette *palette, int *quality, double *mse)
+{
+  int found = 0;
+
+  pthread_mutex_lock(&cache.lock);
+  if (cache.max_bytes) {
+    cache_entry *entry = cache.buckets[key & cache.bucket_mask];
+    while (entry && entry->key != key) {
+      entry = entry->bucket_next;
+    }
+    if (entry) {
+      palette->count = entry->count;
+      memcpy(palette->entries, entry->entries, entry->count * sizeof(liq_color));
+      *quality = entry->quality;
+      *mse = entry->mse;
+      unlink_lru(entry);
+      push_newest(entry);
+      cache.stats.hits++;
+      found = 1;
+    } else {
+      cache.stats.misses++;
+    }
+  }
+  pthread_mutex_unlock(&cache.lock);
+
+  return found;
+}
+
+void palette_cache_put(uint64_t key, const liq_palette *palette, int quality, double mse)
+{
+  size_t bytes = sizeof(cache_entry) + palette->count * sizeof(liq_color);
+
+  pthread_mutex_lock(&cache.lock);
+  if (!cache.max_bytes || bytes > cache.max_bytes) {
+    pthread_mutex_unlock(&cache.lock);
+    return;
+  }
+
+  // another thread may have stored the same image meanwhile
+  cache_entry *entry = cache.buckets[key & cache.bucket_mask];
+  while (entry && entry->key != key) {
+    entry = entry->bucket_next;
+  }
+  if (entry) {
+    remove_entry(entry);
+  }
+
+  while (cache.oldest && cache.stats.bytes + bytes > cache.max_bytes) {
+    remove_entry(cache.oldest);
+    cache.stats.evictions++;
+  }
+
+  entry = malloc(bytes);
+  if (entry) {
+    entry->key = key;
+    entry->bytes = bytes;
+    entry->quality = quality;
+    entry->mse = mse;
+    entry->count = palette->count;
+    memcpy(entry->entries, palette->entries, palette->count * sizeof(liq_color));
+
+    cache_entry **slot = &cache.buckets[key & cache.bucket_mask];
+    entry->bucket_next = *slot;
+    *slot = entry;
+    push_newest(entry);
+    cache.stats.bytes += bytes;
+    cache.stats.entries++;
+  }
+  pthread_mutex_unlock(&cache.lock);
+}
+
+// Hit/miss counters and current size, for sizing the budget.
+void palette_cache_stats(luaquant_cache_stats *stats)
+{
+  pthread_mutex_lock(&cache.lock);
+  *stats = cache.stats;
+  pthread_mutex_unlock(&cache.lock);
+}
+
+static inline uint64_t mix(uint64_t h, uint64_t value)
+{
+  h = (h ^ value) * 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 29);
+}
+
+// 64-bit fingerprint of the decoded image and of every setting that changes
+// the palette, read 8 bytes at a time. step_x x step_y is the cell size the
+// histogram was sampled with (0 x 0 if it had every pixel).
+uint64_t image_fingerprint(const liq_attr *attr, const png24_image *image, unsigned int step_x, unsigned int step_y)
+{
+  uint64_t h = 0x51ED270B27E4C9A1ULL;
+  double gamma = image->gamma;
+  uint64_t gamma_bits;
+  memcpy(&gamma_bits, &gamma, sizeof(gamma_bits));
+
+  h = mix(h, ((uint64_t)image->width << 32) | image->height);
+  h = mix(h, gamma_bits);
+  h = mix(h, ((uint64_t)liq_get_speed(attr) << 48) | ((uint64_t)liq_get_max_colors(attr) << 32) |
+             ((uint64_t)liq_get_min_quality(attr) << 16) | (uint64_t)liq_get_max_quality(attr));
+  h = mix(h, ((uint64_t)step_x << 32) | step_y);
+
+  size_t row_bytes = (size_t)image->width * 4;
+  unsigned int row;
+  for(row = 0; row < image->height; row++) {
+    const unsigned char *px = image->row_pointers[row];
+    size_t i = 0;
+    uint64_t word;
+    for(; i + 8 <= row_bytes; i += 8) {
+      memcpy(&word, px + i, 8);
+      h = mix(h, word);
+    }
+    if (i < row_bytes) {
+      word = 0;
+      memcpy(&word, px + i, row_bytes - i);
+      h = mix(h, word);
+    }
+  }
+  return h;
+}
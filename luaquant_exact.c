@@ -0,0 +1,191 @@
+// Lossless path for images that already fit in a palette: UI assets, icons,
+// and palette PNGs that went through the RGBA decoder. One pass over the
+// decoded pixels collects the distinct colors and writes their indices, and
+// gives up as soon as a 257th color turns up. Runs of the same color are
+// common in such images, so they are skipped four pixels at a time.
+// Streamed images are added block by block and mapped in a second pass.
+//
+// Every fully transparent pixel counts as the same color, as it does in
+// libimagequant, so the output only differs from the input in invisible RGB.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "rwpng.h"
+#include "imagequant/libimagequant.h"
+#include "luaquant.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define EXACT_SLOTS 1024 // open-addressed, at most a quarter full
+
+struct luaquant_exact {
+  uint32_t keys[EXACT_SLOTS];
+  uint16_t slots[EXACT_SLOTS]; // index in colors + 1, 0 = empty
+  uint32_t colors[256];        // in order of appearance
+  unsigned char order[256];    // palette index of each color, once the palette is made
+  unsigned int count;
+};
+
+static void exact_init(luaquant_exact *exact)
+{
+  memset(exact->slots, 0, sizeof(exact->slots));
+  exact->count = 0;
+}
+
+luaquant_exact* new_exact(void)
+{
+  luaquant_exact *exact = malloc(sizeof(luaquant_exact));
+  if (exact) {
+    exact_init(exact);
+  }
+  return exact;
+}
+
+void free_exact(luaquant_exact *exact)
+{
+  free(exact);
+}
+
+static inline uint32_t color_key(const unsigned char *px)
+{
+  uint32_t key = 0;
+  if (px[3]) {
+    memcpy(&key, px, 4);
+  }
+  return key;
+}
+
+// Index of the pixel's color in order of appearance, or -1 once there are
+// too many colors.
+static int exact_index(luaquant_exact *exact, const unsigned char *px)
+{
+  uint32_t key = color_key(px);
+  unsigned int slot = (key * 2654435761u) >> 22;
+
+  while (exact->slots[slot]) {
+    if (exact->keys[slot] == key) {
+      return exact->slots[slot] - 1;
+    }
+    slot = (slot + 1) & (EXACT_SLOTS - 1);
+  }
+
+  if (exact->count == 256) {
+    return -1;
+  }
+  exact->keys[slot] = key;
+  exact->colors[exact->count] = key;
+  exact->slots[slot] = ++exact->count;
+  return exact->count - 1;
+}
+
+// Adds the colors of some RGBA rows, and writes their indices (in order of
+// appearance) to indices unless that is NULL. Returns 0 as soon as the image
+// turns out to have more than 256 colors.
+int exact_add_rows(luaquant_exact *exact, unsigned char **rows, unsigned int width, unsigned int height, unsigned char **indices)
+{
+  if (!width || !height) {
+    return 1;
+  }
+
+  uint32_t last;
+  memcpy(&last, rows[0], 4);
+  int last_index = exact_index(exact, rows[0]);
+  if (last_index < 0) {
+    return 0;
+  }
+
+  unsigned int row, x;
+  for(row = 0; row < height; row++) {
+    const unsigned char *px = rows[row];
+    unsigned char *out = indices ? indices[row] : NULL;
+    x = 0;
+    while (x < width) {
+#ifdef __SSE2__
+      const __m128i run = _mm_set1_epi32(last);
+      while (x + 4 <= width &&
+             _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(px + x*4)), run)) == 0xFFFF) {
+        if (out) memset(out + x, last_index, 4);
+        x += 4;
+      }
+      if (x == width) {
+        break;
+      }
+#endif
+      uint32_t color;
+      memcpy(&color, px + x*4, 4);
+      if (color != last) {
+        last_index = exact_index(exact, px + x*4);
+        if (last_index < 0) {
+          return 0;
+        }
+        last = color;
+      }
+      if (out) out[x] = last_index;
+      x++;
+    }
+  }
+  return 1;
+}
+
+// The colors collected so far as a palette, translucent ones first so tRNS
+// stays short. Returns 1 if that differs from the order of appearance.
+int exact_get_palette(luaquant_exact *exact, liq_palette *palette)
+{
+  unsigned int i, pass, count = 0;
+  int reordered = 0;
+
+  for(pass = 0; pass < 2; pass++) {
+    for(i = 0; i < exact->count; i++) {
+      unsigned char rgba[4];
+      memcpy(rgba, &exact->colors[i], 4);
+      if ((rgba[3] < 255) == !pass) {
+        palette->entries[count] = (liq_color){.r = rgba[0], .g = rgba[1], .b = rgba[2], .a = rgba[3]};
+        exact->order[i] = count;
+        reordered |= i != count;
+        count++;
+      }
+    }
+  }
+  palette->count = count;
+  return reordered;
+}
+
+static void exact_reorder(const luaquant_exact *exact, unsigned char **indices, unsigned int width, unsigned int height)
+{
+  unsigned int row, x;
+  for(row = 0; row < height; row++) {
+    unsigned char *out = indices[row];
+    for(x = 0; x < width; x++) {
+      out[x] = exact->order[out[x]];
+    }
+  }
+}
+
+// After exact_get_palette(): writes the palette indices of rows that only
+// contain colors that were already added.
+void exact_write_rows(luaquant_exact *exact, unsigned char **rows, unsigned int width, unsigned int height, unsigned char **indices)
+{
+  exact_add_rows(exact, rows, width, height, indices);
+  exact_reorder(exact, indices, width, height);
+}
+
+// If the image has at most 256 colors, fills output's rows (which must be
+// allocated for the image's size) with indices and palette with the colors,
+// and returns 1.
+int exact_palette(const png24_image *input, png8_image *output, liq_palette *palette)
+{
+  luaquant_exact exact;
+  exact_init(&exact);
+
+  if (!exact_add_rows(&exact, input->row_pointers, input->width, input->height, output->row_pointers)) {
+    return 0;
+  }
+  if (exact_get_palette(&exact, palette)) {
+    exact_reorder(&exact, output->row_pointers, input->width, input->height);
+  }
+  return 1;
+}
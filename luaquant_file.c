@@ -0,0 +1,150 @@
+// File-to-file conversion for bulk jobs. The input is read into a buffer the
+// context keeps for the next file rather than into a Lua string, so neither
+// the compressed file nor the pixels ever pass through the Lua heap. It isn't
+// mapped: another process truncating the file would then kill this one with
+// SIGBUS, where a short read() is just a READ_ERROR.
+// The output is written with one write() to a temporary file that is renamed
+// over out_path. Readers of out_path see either the old file or the complete
+// new one, never a partial write, and in_path may be the same as out_path.
+// With options.sync the temporary file is also fsynced before the rename, so
+// that still holds after a crash or power loss; it costs a wait for the disk
+// on every file, which bulk runs that can simply be repeated may skip.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "rwpng.h"
+#include "imagequant/libimagequant.h"
+#include "luaquant.h"
+
+static pngquant_error write_atomically(const char *path, const char *data, size_t size, int sync)
+{
+  static unsigned int counter;
+  char tmp_path[PATH_MAX];
+
+  // next to the destination, so rename() stays on one filesystem
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.%u.tmp", path, (long)getpid(),
+               __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED)) >= (int)sizeof(tmp_path)) {
+    return INVALID_ARGUMENT;
+  }
+
+  // a file that is replaced keeps its permissions; a new one gets 0666
+  // minus the process umask, as with fopen()
+  struct stat existing;
+  const int replacing = stat(path, &existing) == 0;
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return CANT_WRITE_ERROR;
+  }
+  if (replacing && fchmod(fd, existing.st_mode & 07777) != 0) {
+    close(fd);
+    unlink(tmp_path);
+    return CANT_WRITE_ERROR;
+  }
+
+  size_t written = 0;
+  while (written < size) {
+    ssize_t n = write(fd, data + written, size - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    written += n;
+  }
+
+  // with sync, the data is on disk before the rename is; otherwise a crash
+  // could leave path pointing at a truncated file
+  if (written < size || (sync && fsync(fd) != 0)) {
+    close(fd);
+    unlink(tmp_path);
+    return CANT_WRITE_ERROR;
+  }
+  if (close(fd) != 0 || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return CANT_WRITE_ERROR;
+  }
+  return SUCCESS;
+}
+
+// Converts the PNG at in_path and writes the result to out_path, with the
+// context's settings and buffers. out_path is left untouched if anything fails.
+pngquant_error context_convert_file(luaquant_context *context, const char *in_path, const char *out_path)
+{
+  if (!in_path || !out_path) {
+    return MISSING_ARGUMENT;
+  }
+
+  int fd = open(in_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return READ_ERROR;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    close(fd);
+    return READ_ERROR;
+  }
+  if (st.st_size > INT_MAX) {
+    close(fd);
+    return TOO_LARGE_FILE;
+  }
+
+  unsigned char *data = context_file_buffer(context, st.st_size);
+  if (!data) {
+    close(fd);
+    return OUT_OF_MEMORY_ERROR;
+  }
+  size_t size = 0;
+  while (size < (size_t)st.st_size) {
+    ssize_t n = read(fd, data + size, st.st_size - size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    size += n;
+  }
+  close(fd);
+  // shorter than fstat() said: someone truncated it while it was read
+  if (size < (size_t)st.st_size) {
+    return READ_ERROR;
+  }
+
+  luaquant_result *result = context_convert(context, (const char *)data, (int)size);
+  if (!result) {
+    return context_error(context);
+  }
+
+  pngquant_error retval = write_atomically(out_path, result->data, result->size, context_options(context)->sync);
+  free_result(result);
+  return retval;
+}
+
+// Use this to re-optimize files on disk without loading them into Lua.
+// Usage:
+//
+// q = require "imagequant"
+// ok, err = q.convert_file("original.png", "optim.png", {speed=10, sync=1})
+//
+// Returns SUCCESS (0) or why the file couldn't be converted or written.
+// For many files, reuse a context with context_convert_file().
+pngquant_error convert_file(const char *in_path, const char *out_path, const luaquant_options *options)
+{
+  luaquant_context *context = new_context(options);
+  if (!context) {
+    return INVALID_ARGUMENT; // options out of range (or no memory)
+  }
+
+  pngquant_error retval = context_convert_file(context, in_path, out_path);
+
+  free_context(context);
+  return retval;
+}
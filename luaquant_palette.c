@@ -0,0 +1,205 @@
+// Post-quantization palette cleanup, run on every palette image before it's
+// encoded:
+//  - entries no pixel uses are dropped (fewer colors can mean fewer bits per pixel)
+//  - duplicate entries, and all fully transparent ones, become a single entry
+//  - translucent entries go first, so tRNS only covers them
+//  - with row filters on, opaque and translucent colors are each chained by
+//    how often they sit next to each other, so neighbouring pixels tend to
+//    get close indices and Sub/Up/Paeth leave small differences for deflate.
+//    Without filtering the index order can't change the compressed size.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "rwpng.h"
+#include "imagequant/libimagequant.h"
+#include "luaquant.h"
+
+// Equal for entries that look the same. Visible colors are flagged above the
+// 32 bits of RGBA, so no color, whatever its alpha, can collide with another
+// or with the transparent key.
+static uint64_t entry_key(const png8_image *image, unsigned int i)
+{
+  if (!image->trans[i] && i < image->num_trans) {
+    return 0; // every invisible color is the same color
+  }
+  const png_color c = image->palette[i];
+  const unsigned int alpha = i < image->num_trans ? image->trans[i] : 255;
+  return 1ULL << 32 | (uint32_t)c.red << 24 | (uint32_t)c.green << 16 | (uint32_t)c.blue << 8 | alpha;
+}
+
+// Appends members (indices into the old palette) to order. Without adjacency
+// they keep their order; with it the most used goes first, then each next one
+// is the color most often adjacent to the previous one.
+static unsigned int chain(const unsigned int *members, unsigned int count, const uint64_t *counts,
+                          const uint32_t *adjacency, unsigned char *order)
+{
+  unsigned char placed[256] = {0};
+  unsigned int n, i, last = 0;
+
+  if (!adjacency) {
+    for(n = 0; n < count; n++) {
+      order[n] = members[n];
+    }
+    return count;
+  }
+  for(n = 0; n < count; n++) {
+    unsigned int best = 0;
+    uint64_t best_score = 0;
+    int found = 0;
+    for(i = 0; i < count; i++) {
+      if (placed[i]) {
+        continue;
+      }
+      uint64_t score = counts[members[i]];
+      if (n) {
+        // adjacency dominates; popularity only breaks ties
+        score += ((uint64_t)adjacency[members[last] * 256 + members[i]] + adjacency[members[i] * 256 + members[last]]) << 32;
+      }
+      if (!found || score > best_score) {
+        best = i;
+        best_score = score;
+        found = 1;
+      }
+    }
+    placed[best] = 1;
+    order[n] = members[best];
+    last = best;
+  }
+  return count;
+}
+
+// Rewrites image's palette as described above and fills lut with where every
+// old index went. counts (uses of each index) may be NULL when the pixels
+// aren't known yet; then nothing is dropped and nothing is chained.
+// Returns 1 if the indices need translating.
+static int rebuild_palette(png8_image *image, const uint64_t *counts, const uint32_t *adjacency, unsigned char lut[256])
+{
+  static const uint64_t all_used[256] = {[0 ... 255] = 1};
+  unsigned int representative[256], translucent[256], opaque[256];
+  unsigned int n_translucent = 0, n_opaque = 0;
+  unsigned int i, j;
+
+  if (!counts) {
+    counts = all_used;
+    adjacency = NULL;
+  }
+
+  for(i = 0; i < image->num_palette; i++) {
+    representative[i] = i;
+    if (!counts[i]) {
+      continue;
+    }
+    const uint64_t key = entry_key(image, i);
+    for(j = 0; j < i; j++) {
+      if (counts[j] && representative[j] == j && entry_key(image, j) == key) {
+        representative[i] = j;
+        break;
+      }
+    }
+    if (representative[i] != i) {
+      continue;
+    }
+    if (i < image->num_trans && image->trans[i] < 255) {
+      translucent[n_translucent++] = i;
+    } else {
+      opaque[n_opaque++] = i;
+    }
+  }
+
+  // merged entries add their uses to the entry they merged into
+  uint64_t merged_counts[256] = {0};
+  for(i = 0; i < image->num_palette; i++) {
+    merged_counts[representative[i]] += counts[i];
+  }
+
+  unsigned char order[256];
+  unsigned int count = chain(translucent, n_translucent, merged_counts, adjacency, order);
+  count += chain(opaque, n_opaque, merged_counts, adjacency, order + count);
+  if (!count) {
+    return 0;
+  }
+
+  png_color palette[256];
+  unsigned char trans[256], new_index[256] = {0};
+  int identity = count == image->num_palette;
+  for(i = 0; i < count; i++) {
+    const unsigned int old = order[i];
+    new_index[old] = i;
+    palette[i] = image->palette[old];
+    trans[i] = old < image->num_trans ? image->trans[old] : 255;
+    if (!trans[i]) {
+      palette[i] = (png_color){0, 0, 0};
+    }
+    identity &= old == i;
+  }
+  for(i = 0; i < image->num_palette; i++) {
+    lut[i] = new_index[representative[i]];
+    identity &= lut[i] == i;
+  }
+
+  memcpy(image->palette, palette, count * sizeof(png_color));
+  memcpy(image->trans, trans, count);
+  image->num_palette = count;
+  image->num_trans = n_translucent;
+  return !identity;
+}
+
+static void translate(png8_image *image, const unsigned char lut[256])
+{
+  unsigned int row, col;
+  for(row = 0; row < image->height; row++) {
+    unsigned char *px = image->row_pointers[row];
+    for(col = 0; col < image->width; col++) {
+      px[col] = lut[px[col]];
+    }
+  }
+}
+
+// Cleans up the palette of a fully remapped image. by_similarity also orders
+// colors for row filtering (pass the row_filters the image will be written with).
+void optimize_palette(png8_image *image, int by_similarity)
+{
+  uint64_t counts[256] = {0};
+  uint32_t *adjacency = NULL;
+  unsigned int row, col;
+
+  if (!image->num_palette) {
+    return;
+  }
+  if (by_similarity) {
+    adjacency = calloc(256 * 256, sizeof(uint32_t));
+  }
+
+  for(row = 0; row < image->height; row++) {
+    const unsigned char *px = image->row_pointers[row];
+    for(col = 0; col < image->width; col++) {
+      counts[px[col]]++;
+    }
+    if (adjacency) {
+      const unsigned char *above = row ? image->row_pointers[row - 1] : NULL;
+      for(col = 0; col < image->width; col++) {
+        if (col) adjacency[px[col - 1] * 256 + px[col]]++;
+        if (above) adjacency[above[col] * 256 + px[col]]++;
+      }
+    }
+  }
+
+  unsigned char lut[256];
+  if (rebuild_palette(image, counts, adjacency, lut)) {
+    translate(image, lut);
+  }
+  free(adjacency);
+}
+
+// For images whose pixels are remapped later (streaming): merges duplicate
+// and transparent entries and puts translucent ones first, from the palette
+// alone. Returns 1 if indices must then be translated through lut.
+int order_palette(png8_image *image, unsigned char lut[256])
+{
+  if (!image->num_palette) {
+    return 0;
+  }
+  return rebuild_palette(image, NULL, NULL, lut);
+}
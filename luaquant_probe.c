@@ -0,0 +1,162 @@
+// Header-only look at a PNG, for admission control and job routing: the
+// dimensions and format from IHDR, an inventory of the chunks (their headers
+// are walked, their data skipped), and what converting it would roughly cost.
+// Nothing is decoded or allocated, so it takes microseconds whatever the file
+// claims to contain.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "rwpng.h"
+#include "imagequant/libimagequant.h"
+#include "luaquant.h"
+
+// libimagequant keeps about two bytes per pixel of importance and edge maps,
+// and caches the image as 16-byte float pixels up to about 64MB.
+#define LIQ_MAP_BYTES_PER_PIXEL 2
+#define LIQ_FLOAT_BYTES_PER_PIXEL 16
+#define LIQ_FLOAT_CACHE_LIMIT (64 * 1024 * 1024)
+
+static void count_chunk(luaquant_probe *info, const unsigned char *name, size_t bytes)
+{
+  unsigned int i;
+  for(i = 0; i < info->chunk_types; i++) {
+    if (0 == memcmp(info->chunks[i].name, name, 4)) {
+      break;
+    }
+  }
+  if (i == info->chunk_types) {
+    if (i == LUAQUANT_PROBE_CHUNK_TYPES) {
+      return;
+    }
+    memcpy(info->chunks[i].name, name, 4);
+    info->chunks[i].name[4] = '\0';
+    info->chunk_types++;
+  }
+  info->chunks[i].count++;
+  info->chunks[i].bytes += bytes;
+}
+
+static void walk_chunks(const unsigned char *data, size_t size, luaquant_probe *info)
+{
+  size_t offset = 8;
+  while (offset + 12 <= size) {
+    const uint32_t length = png_get_uint_32(data + offset);
+    const unsigned char *name = data + offset + 4;
+    if (length > PNG_UINT_31_MAX) {
+      return; // corrupt, and libpng would stop here too
+    }
+
+    count_chunk(info, name, length);
+    if (0 == memcmp(name, "IDAT", 4)) {
+      info->idat_bytes += length;
+    } else if (name[0] & 0x20) {
+      info->metadata_bytes += length;
+    }
+    if (0 == memcmp(name, "IEND", 4)) {
+      info->complete = 1;
+      return;
+    }
+    offset += (size_t)length + 12;
+  }
+}
+
+static uint64_t float_cache(uint64_t pixels)
+{
+  const uint64_t bytes = pixels * LIQ_FLOAT_BYTES_PER_PIXEL;
+  return bytes < LIQ_FLOAT_CACHE_LIMIT ? bytes : LIQ_FLOAT_CACHE_LIMIT;
+}
+
+// Mirrors the paths convert_image() takes: streaming, resizing, sampling.
+static void estimate_cost(const luaquant_options *options, luaquant_probe *info)
+{
+  const uint64_t pixels = (uint64_t)info->width * info->height;
+  const int resizing = options->resize_width > 0 || options->resize_height > 0;
+  const int streaming = options->stream_rows > 0 && !resizing && !info->interlaced;
+  unsigned int out_width = info->width, out_height = info->height;
+
+  if (resizing) {
+    // clamped like resize_image() does
+    resize_fit(info->width, info->height, options->resize_width > 0 ? options->resize_width : 0,
+               options->resize_height > 0 ? options->resize_height : 0, &out_width, &out_height);
+  }
+  const uint64_t out_pixels = (uint64_t)out_width * out_height;
+  const uint64_t sample = options->sample_pixels > 0 ? (uint64_t)options->sample_pixels : LUAQUANT_SAMPLE_PIXELS;
+  const int sampled = options->sample_pixels != LUAQUANT_SAMPLE_ALL && out_pixels > sample;
+
+  info->decode_pixels = streaming ? pixels * 2 : pixels;
+  info->quantize_pixels = sampled ? sample : out_pixels;
+  info->remap_pixels = out_pixels;
+
+  // the encoder's buffer starts at the uncompressed size, up to max_size.
+  // Streaming starts it small and lets it grow (by doubling) with the output,
+  // which is taken to be no bigger than the compressed input.
+  uint64_t encoded = out_pixels + out_height + 1024 + info->metadata_bytes;
+  if (streaming) {
+    uint64_t grown = 2 * ((uint64_t)info->idat_bytes + info->metadata_bytes);
+    if (grown < RWPNG_STREAM_BUFFER_BYTES) grown = RWPNG_STREAM_BUFFER_BYTES;
+    if (grown < encoded) encoded = grown;
+  }
+  if (options->max_size && encoded > options->max_size) {
+    encoded = options->max_size;
+  }
+
+  uint64_t peak;
+  if (streaming) {
+    const uint64_t rows = (unsigned int)options->stream_rows < info->height ? (unsigned int)options->stream_rows : info->height;
+    const uint64_t block = rows * info->width;
+    peak = block * (4 + 1 + LIQ_MAP_BYTES_PER_PIXEL) + float_cache(block) + encoded;
+  } else {
+    peak = pixels * 4 + out_pixels * (1 + LIQ_MAP_BYTES_PER_PIXEL) + float_cache(out_pixels) + encoded;
+    if (resizing) {
+      // the resized copy, and the filter's rows in flight
+      peak += out_pixels * 4 + resize_scratch_bytes(info->width, info->height, out_width, out_height,
+                                                     options->resize_filter, options->remap_threads);
+    }
+  }
+  if (sampled) {
+    peak += sample * 4;
+  }
+  info->peak_memory = peak > SIZE_MAX ? SIZE_MAX : (size_t)peak;
+}
+
+// Use this to route or refuse images before converting them.
+// Usage:
+//
+// q = require "imagequant"
+// info = q.probe(original, {stream_rows=256})
+// if info.width * info.height > 50e6 then send_to_big_pool(original) end
+//
+// Fills info and returns SUCCESS, READ_ERROR if the data doesn't start with a
+// PNG signature and IHDR, or TOO_MANY_PIXELS (info still filled) past
+// options.max_pixels. options may be NULL.
+pngquant_error probe(const char *bitmap, int len, const luaquant_options *options, luaquant_probe *info)
+{
+  static const luaquant_options defaults;
+  rwpng_header header;
+
+  if (!info) {
+    return MISSING_ARGUMENT;
+  }
+  memset(info, 0, sizeof(*info));
+  if (len <= 0 || rwpng_read_header((const unsigned char *)bitmap, len, &header) != SUCCESS) {
+    return READ_ERROR;
+  }
+  if (!options) {
+    options = &defaults;
+  }
+
+  info->width = header.width;
+  info->height = header.height;
+  info->bit_depth = header.bit_depth;
+  info->color_type = header.color_type;
+  info->interlaced = header.interlaced;
+  walk_chunks((const unsigned char *)bitmap, len, info);
+  estimate_cost(options, info);
+
+  if (options->max_pixels && info->width > options->max_pixels / info->height) {
+    return TOO_MANY_PIXELS;
+  }
+  return SUCCESS;
+}
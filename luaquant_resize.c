@@ -0,0 +1,298 @@
+// Downscaling of decoded RGBA images, so thumbnails can be made straight from
+// the original without a decode/resize/encode round trip in another library.
+// The filter is separable: source rows are filtered horizontally into a small
+// ring of float rows, just the window the current output row needs, and every
+// output row is a weighted sum of the rows in its window. Pixels are
+// premultiplied by alpha while filtered, so fully transparent pixels don't
+// bleed their (invisible) color into their neighbours.
+// The output is split across threads in bands of rows, each with its own ring.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "rwpng.h"
+#include "imagequant/libimagequant.h"
+#include "luaquant.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#define omp_get_thread_num() 0
+#endif
+
+#define LANCZOS_LOBES 3
+
+// Source pixels that make up one output pixel along one axis.
+typedef struct {
+  unsigned int *start;
+  unsigned int *count;
+  float *weights; // max_count per output pixel
+  unsigned int max_count;
+} resize_axis;
+
+static double lanczos(double x)
+{
+  if (x < 0) x = -x;
+  if (x < 1e-8) {
+    return 1;
+  }
+  if (x >= LANCZOS_LOBES) {
+    return 0;
+  }
+  double px = M_PI * x;
+  return LANCZOS_LOBES * sin(px) * sin(px / LANCZOS_LOBES) / (px * px);
+}
+
+// How far from its center an output pixel reaches into the source, in source pixels.
+static double axis_support(unsigned int src, unsigned int dst, int filter)
+{
+  const double scale = (double)src / dst; // >= 1, this only shrinks
+  return filter == LUAQUANT_RESIZE_LANCZOS ? LANCZOS_LOBES * scale : scale / 2;
+}
+
+static unsigned int axis_max_count(unsigned int src, unsigned int dst, int filter)
+{
+  return (unsigned int)ceil(axis_support(src, dst, filter) * 2) + 2;
+}
+
+static int axis_init(resize_axis *axis, unsigned int src, unsigned int dst, int filter)
+{
+  const double scale = (double)src / dst;
+  const double support = axis_support(src, dst, filter);
+  unsigned int x, i;
+
+  axis->max_count = axis_max_count(src, dst, filter);
+  axis->start = malloc(dst * sizeof(unsigned int));
+  axis->count = malloc(dst * sizeof(unsigned int));
+  axis->weights = malloc((size_t)dst * axis->max_count * sizeof(float));
+  if (!axis->start || !axis->count || !axis->weights) {
+    return 0;
+  }
+
+  for(x = 0; x < dst; x++) {
+    const double center = (x + 0.5) * scale;
+    double left = floor(center - support), right = ceil(center + support);
+    if (left < 0) left = 0;
+    if (right > src) right = src;
+
+    float *weights = axis->weights + (size_t)x * axis->max_count;
+    double sum = 0;
+    unsigned int count = 0;
+    for(i = (unsigned int)left; i < (unsigned int)right && count < axis->max_count; i++) {
+      double w;
+      if (filter == LUAQUANT_RESIZE_LANCZOS) {
+        w = lanczos((i + 0.5 - center) / scale);
+      } else {
+        // how much of source pixel i the output pixel's box covers
+        double from = center - support > i ? center - support : i;
+        double to = center + support < i + 1 ? center + support : i + 1;
+        w = to > from ? to - from : 0;
+      }
+      weights[count++] = w;
+      sum += w;
+    }
+    // edge pixels lose part of their window; what's left still adds up to 1
+    for(i = 0; i < count; i++) {
+      weights[i] = sum != 0 ? weights[i] / sum : 1.0f / count;
+    }
+    axis->start[x] = (unsigned int)left;
+    axis->count[x] = count;
+  }
+  return 1;
+}
+
+static void axis_free(resize_axis *axis)
+{
+  free(axis->start);
+  free(axis->count);
+  free(axis->weights);
+}
+
+// One source row, premultiplied, to floats.
+static void premultiply_row(const unsigned char *src, float *dst, unsigned int width)
+{
+  unsigned int x;
+  for(x = 0; x < width; x++) {
+    const float a = src[x*4+3] * (1.0f / 255.0f);
+    dst[x*4+0] = src[x*4+0] * a;
+    dst[x*4+1] = src[x*4+1] * a;
+    dst[x*4+2] = src[x*4+2] * a;
+    dst[x*4+3] = src[x*4+3];
+  }
+}
+
+static void filter_row(const float *src, float *dst, const resize_axis *axis, unsigned int width)
+{
+  unsigned int x, i;
+  for(x = 0; x < width; x++) {
+    const float *weights = axis->weights + (size_t)x * axis->max_count;
+    const float *px = src + (size_t)axis->start[x] * 4;
+#ifdef __SSE2__
+    __m128 acc = _mm_setzero_ps();
+    for(i = 0; i < axis->count[x]; i++) {
+      acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weights[i]), _mm_loadu_ps(px + i*4)));
+    }
+    _mm_storeu_ps(dst + x*4, acc);
+#else
+    float r = 0, g = 0, b = 0, a = 0;
+    for(i = 0; i < axis->count[x]; i++) {
+      r += weights[i] * px[i*4+0];
+      g += weights[i] * px[i*4+1];
+      b += weights[i] * px[i*4+2];
+      a += weights[i] * px[i*4+3];
+    }
+    dst[x*4+0] = r; dst[x*4+1] = g; dst[x*4+2] = b; dst[x*4+3] = a;
+#endif
+  }
+}
+
+static inline unsigned char to_byte(float v)
+{
+  return v <= 0 ? 0 : v >= 255 ? 255 : (unsigned char)(v + 0.5f);
+}
+
+static void unpremultiply_row(const float *src, unsigned char *dst, unsigned int width)
+{
+  unsigned int x;
+  for(x = 0; x < width; x++) {
+    const float a = src[x*4+3];
+    const unsigned char alpha = to_byte(a);
+    if (!alpha) {
+      memset(dst + x*4, 0, 4);
+      continue;
+    }
+    const float unpremultiply = 255.0f / a;
+    dst[x*4+0] = to_byte(src[x*4+0] * unpremultiply);
+    dst[x*4+1] = to_byte(src[x*4+1] * unpremultiply);
+    dst[x*4+2] = to_byte(src[x*4+2] * unpremultiply);
+    dst[x*4+3] = alpha;
+  }
+}
+
+// Floats one thread works in: a source row, the ring of horizontally
+// filtered rows, and the output row being summed.
+static size_t thread_floats(unsigned int src_width, unsigned int src_height, unsigned int dst_width, unsigned int dst_height, int filter)
+{
+  return ((size_t)src_width + (size_t)dst_width * (axis_max_count(src_height, dst_height, filter) + 1)) * 4;
+}
+
+// Threads resize_rgba() actually uses for the given threads argument.
+static int resize_threads(unsigned int src_width, unsigned int src_height, int threads)
+{
+  // small thumbnails aren't worth waking the thread pool for
+  if ((uint64_t)src_width * src_height <= 256 * 1024) {
+    return 1;
+  }
+  return threads > 0 ? threads : omp_get_max_threads();
+}
+
+// Memory resize_rgba() allocates besides dst, for estimating a conversion's peak.
+size_t resize_scratch_bytes(unsigned int src_width, unsigned int src_height, unsigned int dst_width, unsigned int dst_height,
+                            int filter, int threads)
+{
+  const size_t axes = ((size_t)dst_width * axis_max_count(src_width, dst_width, filter) +
+                       (size_t)dst_height * axis_max_count(src_height, dst_height, filter)) * sizeof(float) +
+                      ((size_t)dst_width + dst_height) * 2 * sizeof(unsigned int);
+  return thread_floats(src_width, src_height, dst_width, dst_height, filter) * sizeof(float) *
+         resize_threads(src_width, src_height, threads) + axes;
+}
+
+// Output rows first to end: each source row in their windows is filtered
+// once, into ring slot (row % window_rows), which by then holds a row no
+// later output row needs.
+static void resize_band(unsigned char **src_rows, unsigned int src_width, unsigned char *dst, unsigned int dst_width,
+                        const resize_axis *horizontal, const resize_axis *vertical, unsigned int first, unsigned int end, float *scratch)
+{
+  const size_t row_floats = (size_t)dst_width * 4;
+  const unsigned int window_rows = vertical->max_count;
+  float *line = scratch;
+  float *window = line + (size_t)src_width * 4;
+  float *sum = window + row_floats * window_rows;
+  unsigned int next = vertical->start[first]; // first source row not filtered yet
+  unsigned int row, i;
+  size_t x;
+
+  for(row = first; row < end; row++) {
+    const unsigned int from = vertical->start[row], to = from + vertical->count[row];
+    const float *weights = vertical->weights + (size_t)row * vertical->max_count;
+    if (next < from) {
+      next = from;
+    }
+    for(; next < to; next++) {
+      premultiply_row(src_rows[next], line, src_width);
+      filter_row(line, window + row_floats * (next % window_rows), horizontal, dst_width);
+    }
+
+    memset(sum, 0, row_floats * sizeof(float));
+    for(i = 0; i < vertical->count[row]; i++) {
+      const float w = weights[i];
+      const float *src = window + row_floats * ((from + i) % window_rows);
+      for(x = 0; x < row_floats; x++) {
+        sum[x] += w * src[x];
+      }
+    }
+    unpremultiply_row(sum, dst + row_floats * row, dst_width);
+  }
+}
+
+// Scales src_rows (RGBA, src_width x src_height) down into dst (RGBA,
+// dst_width x dst_height, rows packed), with LUAQUANT_RESIZE_BOX or
+// LUAQUANT_RESIZE_LANCZOS, in bands on up to max_threads threads (0 = one
+// per core). Returns 0 when out of memory.
+int resize_rgba(unsigned char **src_rows, unsigned int src_width, unsigned int src_height,
+                unsigned char *dst, unsigned int dst_width, unsigned int dst_height, int filter, int max_threads)
+{
+  resize_axis horizontal = {}, vertical = {};
+  const int threads = resize_threads(src_width, src_height, max_threads);
+  const size_t scratch_floats = thread_floats(src_width, src_height, dst_width, dst_height, filter);
+  float *scratch = malloc(scratch_floats * sizeof(float) * threads);
+  int ok = scratch &&
+           axis_init(&horizontal, src_width, dst_width, filter) &&
+           axis_init(&vertical, src_height, dst_height, filter);
+
+  if (ok) {
+    // bands overlap by a window's worth of source rows, which both filter
+    const int bands = (unsigned int)threads < dst_height ? threads : 1;
+    int band;
+
+    #pragma omp parallel for num_threads(threads) if (bands > 1) schedule(static)
+    for(band = 0; band < bands; band++) {
+      resize_band(src_rows, src_width, dst, dst_width, &horizontal, &vertical,
+                  (uint64_t)dst_height * band / bands, (uint64_t)dst_height * (band + 1) / bands,
+                  scratch + scratch_floats * omp_get_thread_num());
+    }
+  }
+
+  axis_free(&horizontal);
+  axis_free(&vertical);
+  free(scratch);
+  return ok;
+}
+
+// The largest size that fits in max_width x max_height (0 = unbounded) with
+// the image's aspect ratio. Never larger than the image itself.
+void resize_fit(unsigned int width, unsigned int height, unsigned int max_width, unsigned int max_height,
+                unsigned int *fit_width, unsigned int *fit_height)
+{
+  double scale = 1;
+  if (max_width && max_width < width) {
+    scale = (double)max_width / width;
+  }
+  if (max_height && max_height < height && (double)max_height / height < scale) {
+    scale = (double)max_height / height;
+  }
+  *fit_width = scale < 1 ? (unsigned int)(width * scale + 0.5) : width;
+  *fit_height = scale < 1 ? (unsigned int)(height * scale + 0.5) : height;
+  if (!*fit_width) *fit_width = 1;
+  if (!*fit_height) *fit_height = 1;
+  // rounding must not undo the limit
+  if (max_width && *fit_width > max_width) *fit_width = max_width;
+  if (max_height && *fit_height > max_height) *fit_height = max_height;
+}
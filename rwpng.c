@@ -36,8 +36,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "png.h"
+#include "zlib.h"
 #include "rwpng.h"
 #if USE_LCMS
 #include "lcms2.h"
@@ -54,53 +56,68 @@
 #include <omp.h>
 #else
 #define omp_get_max_threads() 1
+#define omp_get_thread_num() 0
 #endif
 
 static void rwpng_error_handler(png_structp png_ptr, png_const_charp msg);
 static void rwpng_warning_stderr_handler(png_structp png_ptr, png_const_charp msg);
 static void rwpng_warning_silent_handler(png_structp png_ptr, png_const_charp msg);
-int rwpng_read_image24_cocoa(FILE *infile, png24_image *mainprog_ptr);
+int rwpng_read_image24_cocoa(const unsigned char *data, png_size_t size, png24_image *mainprog_ptr);
 
 
-struct rwpng_read_data {
-    FILE *const fp;
-    png_size_t bytes_read;
-};
-
 static void user_read_data(png_structp png_ptr, png_bytep data, png_size_t length)
 {
     struct rwpng_read_data *read_data = (struct rwpng_read_data *)png_get_io_ptr(png_ptr);
 
-    png_size_t read = fread(data, 1, length, read_data->fp);
-    if (!read) {
+    if (length > read_data->size - read_data->bytes_read) {
         png_error(png_ptr, "Read error");
     }
-    read_data->bytes_read += read;
+    memcpy(data, read_data->data + read_data->bytes_read, length);
+    read_data->bytes_read += length;
 }
 
-struct rwpng_write_data {
-    unsigned char *buffer;
-    png_size_t bytes_written;
-    png_size_t bytes_left;
-};
+/* what went wrong when libpng longjmp()ed out of a write */
+static pngquant_error rwpng_write_error(const struct rwpng_write_data *write_data)
+{
+    if (write_data->too_large) return TOO_LARGE_FILE;
+    if (write_data->out_of_memory) return PNG_OUT_OF_MEMORY_ERROR;
+    return LIBPNG_FATAL_ERROR;
+}
 
 static void user_write_data(png_structp png_ptr, png_bytep data, png_size_t length)
 {
     struct rwpng_write_data *write_data = (struct rwpng_write_data *)png_get_io_ptr(png_ptr);
 
-    if (length <= write_data->bytes_left) {
-        memcpy(write_data->buffer + write_data->bytes_written, data, length);
-        write_data->bytes_left -= length;
-        write_data->bytes_written += length;
-    } else {
-        write_data->bytes_written = 0;
-        write_data->bytes_left = 0;
+    png_size_t needed = write_data->bytes_written + length;
+    if (write_data->maximum_size && needed > write_data->maximum_size) {
+        /* give up right away rather than compressing the rest of an image
+         * that can't be used; this is expected, so no png_error() message */
+        write_data->too_large = 1;
+        longjmp(((rwpng_png_image *)png_get_error_ptr(png_ptr))->jmpbuf, 1);
+    }
+
+    if (needed > write_data->capacity) {
+        png_size_t capacity = write_data->capacity * 2;
+        if (capacity < needed) capacity = needed;
+        if (write_data->maximum_size && capacity > write_data->maximum_size) capacity = write_data->maximum_size;
+
+        unsigned char *buffer = realloc(write_data->buffer, capacity);
+        if (!buffer) {
+            write_data->out_of_memory = 1;
+            png_error(png_ptr, "Out of memory");
+        }
+        write_data->buffer = buffer;
+        write_data->capacity = capacity;
     }
+
+    memcpy(write_data->buffer + write_data->bytes_written, data, length);
+    write_data->bytes_written += length;
 }
 
 static void user_flush_data(png_structp png_ptr)
 {
     // libpng never calls this :(
+    (void)png_ptr;
 }
 
 
@@ -119,6 +136,43 @@ static png_bytepp rwpng_create_row_pointers(png_infop info_ptr, png_structp png_
     return row_pointers;
 }
 
+/* metadata chunks libpng knows; they reach read_chunk_callback like unknown
+ * ones, so libpng never parses (or inflates) what is then thrown away */
+static const png_byte rwpng_metadata_chunks[] = "tEXt\0zTXt\0iTXt\0eXIf\0tIME\0pHYs";
+#define RWPNG_METADATA_CHUNKS 6
+
+static int rwpng_is_metadata(const png_byte *name)
+{
+    for(int i = 0; i < RWPNG_METADATA_CHUNKS; i++) {
+        if (0 == memcmp(rwpng_metadata_chunks + i * 5, name, 4)) return 1;
+    }
+    return 0;
+}
+
+/* whether list (names separated by anything that isn't a letter) has name */
+static int rwpng_chunk_listed(const char *list, const png_byte *name)
+{
+    for(const char *p = list; *p; p++) {
+        if ((p == list || !isalpha((unsigned char)p[-1])) &&
+            0 == strncmp(p, (const char *)name, 4) && !isalpha((unsigned char)p[4])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int rwpng_chunk_kept(const png24_image *mainprog_ptr, const png_byte *name)
+{
+    if (mainprog_ptr->keep_chunks) {
+        return rwpng_chunk_listed(mainprog_ptr->keep_chunks, name);
+    }
+    switch(mainprog_ptr->chunk_policy) {
+        case RWPNG_CHUNKS_NONE: return 0;
+        case RWPNG_CHUNKS_ALL: return 1;
+        default: return !rwpng_is_metadata(name);
+    }
+}
+
 static int read_chunk_callback(png_structp png_ptr, png_unknown_chunkp in_chunk)
 {
     if (0 == memcmp("iCCP", in_chunk->name, 5) ||
@@ -127,54 +181,189 @@ static int read_chunk_callback(png_structp png_ptr, png_unknown_chunkp in_chunk)
         return 0; // not handled
     }
 
-    struct rwpng_chunk **head = (struct rwpng_chunk **)png_get_user_chunk_ptr(png_ptr);
+    png24_image *mainprog_ptr = (png24_image *)png_get_user_chunk_ptr(png_ptr);
+    if (!rwpng_chunk_kept(mainprog_ptr, in_chunk->name)) {
+        return 1; // dropped without a copy
+    }
 
-    struct rwpng_chunk *chunk = malloc(sizeof(struct rwpng_chunk));
+    /* png_malloc() goes through the image's allocator, if it has one */
+    struct rwpng_chunk *chunk = png_malloc(png_ptr, sizeof(struct rwpng_chunk));
     memcpy(chunk->name, in_chunk->name, 5);
     chunk->size = in_chunk->size;
     chunk->location = in_chunk->location;
-    chunk->data = in_chunk->size ? malloc(in_chunk->size) : NULL;
-    if (in_chunk->size) {
+    chunk->data = NULL;
+    chunk->borrowed = 0;
+
+    if (in_chunk->size && mainprog_ptr->borrow_chunks) {
+        /* libpng has just read the chunk's type, data and CRC out of the input */
+        const struct rwpng_read_data *read_data = png_get_io_ptr(png_ptr);
+        if (read_data->bytes_read >= in_chunk->size + 8) {
+            const unsigned char *data = read_data->data + read_data->bytes_read - 4 - in_chunk->size;
+            if (0 == memcmp(data - 4, in_chunk->name, 4)) {
+                chunk->data = (png_byte *)data;
+                chunk->borrowed = 1;
+            }
+        }
+    }
+    if (in_chunk->size && !chunk->borrowed) {
+        chunk->data = png_malloc(png_ptr, in_chunk->size);
         memcpy(chunk->data, in_chunk->data, in_chunk->size);
     }
 
-    chunk->next = *head;
-    *head = chunk;
+    chunk->next = mainprog_ptr->chunks;
+    mainprog_ptr->chunks = chunk;
 
     return 1; // marks as "handled", libpng won't store it
 }
 
-pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr, int verbose)
+/* what to pass png_read_end(): given NULL, it skips every chunk after IDAT unseen */
+static png_infop rwpng_chunks_after_idat(const png24_image *mainprog_ptr, png_infop info_ptr)
 {
-    png_structp  png_ptr = NULL;
-    png_infop    info_ptr = NULL;
-    png_size_t   rowbytes;
-    int          color_type, bit_depth;
+    return mainprog_ptr->chunk_policy == RWPNG_CHUNKS_NONE && !mainprog_ptr->keep_chunks ? NULL : info_ptr;
+}
+
+static void rwpng_set_chunk_handling(png_structp png_ptr, png24_image *mainprog_ptr)
+{
+#ifdef PNG_HANDLE_AS_UNKNOWN_SUPPORTED
+    png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_NEVER, rwpng_metadata_chunks, RWPNG_METADATA_CHUNKS);
+#endif
+    if (mainprog_ptr->chunk_policy == RWPNG_CHUNKS_NONE && !mainprog_ptr->keep_chunks) {
+        /* without a callback libpng skips the chunks' data instead of buffering it */
+        png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_NEVER, NULL, 0);
+        return;
+    }
+    png_set_read_user_chunk_fn(png_ptr, mainprog_ptr, read_chunk_callback);
+}
+
+#ifdef PNG_USER_MEM_SUPPORTED
+static png_voidp rwpng_png_malloc(png_structp png_ptr, png_alloc_size_t size)
+{
+    const rwpng_allocator *allocator = png_get_mem_ptr(png_ptr);
+    return allocator->malloc_fn(allocator->opaque, size);
+}
+
+static void rwpng_png_free(png_structp png_ptr, png_voidp ptr)
+{
+    const rwpng_allocator *allocator = png_get_mem_ptr(png_ptr);
+    allocator->free_fn(allocator->opaque, ptr);
+}
+#endif
 
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, mainprog_ptr,
+static png_structp rwpng_create_read_struct(png24_image *mainprog_ptr, int verbose)
+{
+#ifdef PNG_USER_MEM_SUPPORTED
+    if (mainprog_ptr->allocator) {
+        return png_create_read_struct_2(PNG_LIBPNG_VER_STRING, mainprog_ptr,
+          rwpng_error_handler, verbose ? rwpng_warning_stderr_handler : rwpng_warning_silent_handler,
+          (png_voidp)mainprog_ptr->allocator, rwpng_png_malloc, rwpng_png_free);
+    }
+#endif
+    return png_create_read_struct(PNG_LIBPNG_VER_STRING, mainprog_ptr,
       rwpng_error_handler, verbose ? rwpng_warning_stderr_handler : rwpng_warning_silent_handler);
-    if (!png_ptr) {
-        return PNG_OUT_OF_MEMORY_ERROR;   /* out of memory */
+}
+
+/* reads everything up to the image data and registers the transforms that
+ * turn any PNG into 8-bit RGBA; the caller must have called setjmp() */
+/* Decides whether the rows can be decoded as they are and widened to RGBA by
+ * rwpng_expand_row(), which is much faster than libpng's transforms. That
+ * covers 8/16-bit gray, gray+alpha, RGB and RGBA and all palette images, as
+ * long as they aren't interlaced. Gray and RGB with a tRNS color key and
+ * gray below 8 bits are left to libpng. */
+static int rwpng_setup_expander(png_structp png_ptr, png_infop info_ptr, int color_type, int bit_depth, rwpng_expander *expander)
+{
+    expander->channels = 0;
+
+    if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+        return 0;
     }
 
-    info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        png_destroy_read_struct(&png_ptr, NULL, NULL);
-        return PNG_OUT_OF_MEMORY_ERROR;   /* out of memory */
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_colorp palette = NULL;
+        png_bytep trans_alpha = NULL;
+        int num_palette = 0, num_trans = 0;
+        png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette);
+        png_get_tRNS(png_ptr, info_ptr, &trans_alpha, &num_trans, NULL);
+
+        /* out-of-range indices come out opaque black, as with png_set_expand() */
+        for(int i = 0; i < 256; i++) {
+            expander->rgba_palette[i][0] = i < num_palette ? palette[i].red : 0;
+            expander->rgba_palette[i][1] = i < num_palette ? palette[i].green : 0;
+            expander->rgba_palette[i][2] = i < num_palette ? palette[i].blue : 0;
+            expander->rgba_palette[i][3] = i < num_trans && trans_alpha ? trans_alpha[i] : 255;
+        }
+        if (bit_depth < 8) {
+            png_set_packing(png_ptr);
+        }
+        expander->palette = 1;
+        expander->bit_depth = 8;
+        expander->channels = 1;
+        return 1;
     }
 
-    /* setjmp() must be called in every function that calls a non-trivial
-     * libpng function */
+    if (bit_depth < 8 || png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+        return 0;
+    }
+    if (color_type == PNG_COLOR_TYPE_RGB_ALPHA && bit_depth == 8) {
+        return 0; /* already RGBA8, nothing to widen */
+    }
 
-    if (setjmp(mainprog_ptr->jmpbuf)) {
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        return LIBPNG_FATAL_ERROR;   /* fatal libpng error (via longjmp()) */
+    expander->palette = 0;
+    expander->bit_depth = bit_depth;
+    expander->channels = png_get_channels(png_ptr, info_ptr);
+    return 1;
+}
+
+static void rwpng_reserve_raw_row(png_structp png_ptr, png_infop info_ptr, png24_image *mainprog_ptr)
+{
+    png_size_t rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    if (mainprog_ptr->raw_row_capacity < rowbytes) {
+        free(mainprog_ptr->raw_row);
+        mainprog_ptr->raw_row_capacity = 0;
+        if ((mainprog_ptr->raw_row = malloc(rowbytes)) == NULL) {
+            png_error(png_ptr, "out of memory");
+        }
+        mainprog_ptr->raw_row_capacity = rowbytes;
     }
+}
 
-    png_set_read_user_chunk_fn(png_ptr, &mainprog_ptr->chunks, read_chunk_callback);
+/* Only looks at the first 33 bytes: no libpng, nothing allocated */
+pngquant_error rwpng_read_header(const unsigned char *data, png_size_t size, rwpng_header *header)
+{
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
 
-    struct rwpng_read_data read_data = {infile, 0};
-    png_set_read_fn(png_ptr, &read_data, user_read_data);
+    if (!data || size < 8 + 8 + 13 || memcmp(data, signature, 8) ||
+        png_get_uint_32(data + 8) != 13 || memcmp(data + 12, "IHDR", 4)) {
+        return READ_ERROR;
+    }
+
+    const unsigned char *ihdr = data + 16;
+    header->width = png_get_uint_32(ihdr);
+    header->height = png_get_uint_32(ihdr + 4);
+    header->bit_depth = ihdr[8];
+    header->color_type = ihdr[9];
+    header->interlaced = ihdr[12] != PNG_INTERLACE_NONE;
+    if (!header->width || !header->height || header->width > PNG_UINT_31_MAX || header->height > PNG_UINT_31_MAX) {
+        return READ_ERROR;
+    }
+    return SUCCESS;
+}
+
+/* max_pixels is checked against IHDR before libpng is even set up, so a
+ * small file claiming a huge image is turned away for free. Files whose
+ * header can't be read are left for libpng to report. */
+static pngquant_error rwpng_check_pixels(const unsigned char *data, png_size_t size, const png24_image *mainprog_ptr)
+{
+    rwpng_header header;
+    if (mainprog_ptr->max_pixels && rwpng_read_header(data, size, &header) == SUCCESS &&
+        header.width > mainprog_ptr->max_pixels / header.height) {
+        return TOO_MANY_PIXELS;
+    }
+    return SUCCESS;
+}
+
+static void rwpng_read_info_rgba(png_structp png_ptr, png_infop info_ptr, png24_image *mainprog_ptr, int *color_type_p, rwpng_expander *expander)
+{
+    int          color_type, bit_depth;
 
     png_read_info(png_ptr, info_ptr);  /* read all PNG info up to image data */
 
@@ -193,23 +382,22 @@ pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr
 
     /* GRR TO DO:  preserve all safe-to-copy ancillary PNG chunks */
 
-    if (!(color_type & PNG_COLOR_MASK_ALPHA)) {
+    if (rwpng_setup_expander(png_ptr, info_ptr, color_type, bit_depth, expander)) {
+        /* rows are read raw and widened by rwpng_expand_row() */
+    } else if (!(color_type & PNG_COLOR_MASK_ALPHA)) {
 #ifdef PNG_READ_FILLER_SUPPORTED
         png_set_expand(png_ptr);
         png_set_filler(png_ptr, 65535L, PNG_FILLER_AFTER);
 #else
-        fprintf(stderr, "pngquant readpng:  image is neither RGBA nor GA\n");
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        mainprog_ptr->retval = 26;
-        return mainprog_ptr->retval;
+        png_error(png_ptr, "pngquant readpng:  image is neither RGBA nor GA");
 #endif
     }
 
-    if (bit_depth == 16) {
+    if (!expander->channels && bit_depth == 16) {
         png_set_strip_16(png_ptr);
     }
 
-    if (!(color_type & PNG_COLOR_MASK_COLOR)) {
+    if (!expander->channels && !(color_type & PNG_COLOR_MASK_COLOR)) {
         png_set_gray_to_rgb(png_ptr);
     }
 
@@ -229,24 +417,93 @@ pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr
 
     png_read_update_info(png_ptr, info_ptr);
 
-    rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    if (expander->channels) {
+        rwpng_reserve_raw_row(png_ptr, info_ptr, mainprog_ptr);
+    }
+
+    *color_type_p = color_type;
+}
+
+pngquant_error rwpng_read_image24_libpng(const unsigned char *data, png_size_t size, png24_image *mainprog_ptr, int verbose)
+{
+    png_structp  png_ptr = NULL;
+    png_infop    info_ptr = NULL;
+    png_size_t   rowbytes;
+    int          color_type;
+    rwpng_expander expander;
 
-    if ((mainprog_ptr->rgba_data = malloc(rowbytes*mainprog_ptr->height)) == NULL) {
-        fprintf(stderr, "pngquant readpng:  unable to allocate image data\n");
+    png_ptr = rwpng_create_read_struct(mainprog_ptr, verbose);
+    if (!png_ptr) {
+        return PNG_OUT_OF_MEMORY_ERROR;   /* out of memory */
+    }
+
+    info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        return PNG_OUT_OF_MEMORY_ERROR;   /* out of memory */
+    }
+
+    /* setjmp() must be called in every function that calls a non-trivial
+     * libpng function */
+
+    if (setjmp(mainprog_ptr->jmpbuf)) {
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        return PNG_OUT_OF_MEMORY_ERROR;
+        return LIBPNG_FATAL_ERROR;   /* fatal libpng error (via longjmp()) */
     }
 
-    png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, mainprog_ptr->rgba_data, mainprog_ptr->height, 0);
+    rwpng_set_chunk_handling(png_ptr, mainprog_ptr);
+
+    struct rwpng_read_data read_data = {data, size, 0};
+    png_set_read_fn(png_ptr, &read_data, user_read_data);
+
+    rwpng_read_info_rgba(png_ptr, info_ptr, mainprog_ptr, &color_type, &expander);
+
+    rowbytes = expander.channels ? (png_size_t)mainprog_ptr->width * 4 : png_get_rowbytes(png_ptr, info_ptr);
+
+    /* buffers left over from a previous image are reused when they are
+     * big enough, so a long-lived png24_image doesn't reallocate per call */
+
+    if (mainprog_ptr->rgba_data_capacity < rowbytes*mainprog_ptr->height) {
+        free(mainprog_ptr->rgba_data);
+        mainprog_ptr->rgba_data_capacity = 0;
+        if ((mainprog_ptr->rgba_data = malloc(rowbytes*mainprog_ptr->height)) == NULL) {
+            fprintf(stderr, "pngquant readpng:  unable to allocate image data\n");
+            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+            return PNG_OUT_OF_MEMORY_ERROR;
+        }
+        mainprog_ptr->rgba_data_capacity = rowbytes*mainprog_ptr->height;
+    }
+
+    if (mainprog_ptr->row_pointers_capacity < mainprog_ptr->height) {
+        free(mainprog_ptr->row_pointers);
+        mainprog_ptr->row_pointers_capacity = 0;
+        if ((mainprog_ptr->row_pointers = malloc(mainprog_ptr->height * sizeof(mainprog_ptr->row_pointers[0]))) == NULL) {
+            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+            return PNG_OUT_OF_MEMORY_ERROR;
+        }
+        mainprog_ptr->row_pointers_capacity = mainprog_ptr->height;
+    }
+
+    png_bytepp row_pointers = (png_bytepp)mainprog_ptr->row_pointers;
+    for(unsigned int row = 0;  row < mainprog_ptr->height;  ++row) {
+        row_pointers[row] = mainprog_ptr->rgba_data + row * rowbytes;
+    }
 
     /* now we can go ahead and just read the whole image */
 
-    png_read_image(png_ptr, row_pointers);
+    if (expander.channels) {
+        for(unsigned int row = 0;  row < mainprog_ptr->height;  ++row) {
+            png_read_row(png_ptr, mainprog_ptr->raw_row, NULL);
+            rwpng_expand_row(&expander, row_pointers[row], mainprog_ptr->raw_row, mainprog_ptr->width);
+        }
+    } else {
+        png_read_image(png_ptr, row_pointers);
+    }
 
     /* and we're done!  (png_read_end() can be omitted if no processing of
      * post-IDAT text/time/etc. is desired) */
 
-    png_read_end(png_ptr, NULL);
+    png_read_end(png_ptr, rwpng_chunks_after_idat(mainprog_ptr, info_ptr));
 
 #if USE_LCMS
 #if PNG_LIBPNG_VER < 10500
@@ -298,7 +555,7 @@ pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr
         WhitePoint.Y = Primaries.Red.Y = Primaries.Green.Y = Primaries.Blue.Y = 1.0;
 
         cmsToneCurve *GammaTable[3];
-        GammaTable[0] = GammaTable[1] = GammaTable[2] = cmsBuildGamma(NULL, 1/gamma);
+        GammaTable[0] = GammaTable[1] = GammaTable[2] = cmsBuildGamma(NULL, 1/mainprog_ptr->gamma);
 
         hInProfile = cmsCreateRGBProfile(&WhitePoint, &Primaries, GammaTable);
 
@@ -338,28 +595,126 @@ pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
     mainprog_ptr->file_size = read_data.bytes_read;
-    mainprog_ptr->row_pointers = (unsigned char **)row_pointers;
 
     return SUCCESS;
 }
 
 
-static void rwpng_free_chunks(struct rwpng_chunk *chunk) {
-    if (!chunk) return;
-    rwpng_free_chunks(chunk->next);
-    free(chunk->data);
-    free(chunk);
+pngquant_error rwpng_read_rows_begin(rwpng_row_reader *reader, const unsigned char *data, png_size_t size, png24_image *mainprog_ptr, int verbose)
+{
+    int color_type;
+
+    *reader = (rwpng_row_reader){.read_data = {data, size, 0}};
+
+    pngquant_error retval = rwpng_check_pixels(data, size, mainprog_ptr);
+    if (retval != SUCCESS) {
+        return retval;
+    }
+
+    reader->png_ptr = rwpng_create_read_struct(mainprog_ptr, verbose);
+    if (!reader->png_ptr) {
+        return PNG_OUT_OF_MEMORY_ERROR;
+    }
+
+    reader->info_ptr = png_create_info_struct(reader->png_ptr);
+    if (!reader->info_ptr) {
+        rwpng_read_rows_abort(reader);
+        return PNG_OUT_OF_MEMORY_ERROR;
+    }
+
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        rwpng_read_rows_abort(reader);
+        return LIBPNG_FATAL_ERROR;
+    }
+
+    rwpng_set_chunk_handling(reader->png_ptr, mainprog_ptr);
+    png_set_read_fn(reader->png_ptr, &reader->read_data, user_read_data);
+
+    rwpng_read_info_rgba(reader->png_ptr, reader->info_ptr, mainprog_ptr, &color_type, &reader->expander);
+
+    /* interlaced images need every pass of the whole frame before any row is complete */
+    if (png_get_interlace_type(reader->png_ptr, reader->info_ptr) != PNG_INTERLACE_NONE) {
+        rwpng_read_rows_abort(reader);
+        return INVALID_ARGUMENT;
+    }
+
+    return SUCCESS;
+}
+
+pngquant_error rwpng_read_rows(rwpng_row_reader *reader, png24_image *mainprog_ptr, unsigned char **row_pointers, unsigned int num_rows)
+{
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        rwpng_read_rows_abort(reader);
+        return LIBPNG_FATAL_ERROR;
+    }
+
+    if (reader->expander.channels) {
+        for(unsigned int row = 0; row < num_rows; row++) {
+            png_read_row(reader->png_ptr, mainprog_ptr->raw_row, NULL);
+            rwpng_expand_row(&reader->expander, row_pointers[row], mainprog_ptr->raw_row, mainprog_ptr->width);
+        }
+    } else {
+        png_read_rows(reader->png_ptr, row_pointers, NULL, num_rows);
+    }
+    return SUCCESS;
+}
+
+/* reads chunks that follow the image data, then releases the reader */
+pngquant_error rwpng_read_rows_end(rwpng_row_reader *reader, png24_image *mainprog_ptr)
+{
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        rwpng_read_rows_abort(reader);
+        return LIBPNG_FATAL_ERROR;
+    }
+
+    png_read_end(reader->png_ptr, rwpng_chunks_after_idat(mainprog_ptr, reader->info_ptr));
+    mainprog_ptr->file_size = reader->read_data.bytes_read;
+
+    rwpng_read_rows_abort(reader);
+    return SUCCESS;
+}
+
+void rwpng_read_rows_abort(rwpng_row_reader *reader)
+{
+    if (reader->png_ptr) {
+        png_destroy_read_struct(&reader->png_ptr, reader->info_ptr ? &reader->info_ptr : NULL, NULL);
+    }
+    reader->png_ptr = NULL;
+    reader->info_ptr = NULL;
+}
+
+
+void rwpng_free_chunks(struct rwpng_chunk *chunk, const rwpng_allocator *allocator) {
+    /* a loop, files can have thousands of chunks */
+    while (chunk) {
+        struct rwpng_chunk *next = chunk->next;
+        png_byte *data = chunk->borrowed ? NULL : chunk->data;
+        if (allocator) {
+            allocator->free_fn(allocator->opaque, data);
+            allocator->free_fn(allocator->opaque, chunk);
+        } else {
+            free(data);
+            free(chunk);
+        }
+        chunk = next;
+    }
 }
 
 void rwpng_free_image24(png24_image *image)
 {
     free(image->row_pointers);
     image->row_pointers = NULL;
+    image->row_pointers_capacity = 0;
 
     free(image->rgba_data);
     image->rgba_data = NULL;
+    image->rgba_data_capacity = 0;
 
-    rwpng_free_chunks(image->chunks);
+    free(image->raw_row);
+    image->raw_row = NULL;
+    image->raw_row_capacity = 0;
+
+    rwpng_free_chunks(image->chunks, image->allocator);
     image->chunks = NULL;
 }
 
@@ -367,28 +722,40 @@ void rwpng_free_image8(png8_image *image)
 {
     free(image->indexed_data);
     image->indexed_data = NULL;
+    image->indexed_data_capacity = 0;
 
     free(image->row_pointers);
     image->row_pointers = NULL;
+    image->row_pointers_capacity = 0;
 
-    rwpng_free_chunks(image->chunks);
+    rwpng_free_chunks(image->chunks, image->allocator);
     image->chunks = NULL;
 }
 
-pngquant_error rwpng_read_image24(FILE *infile, png24_image *input_image_p, int verbose)
+pngquant_error rwpng_read_image24(const unsigned char *data, png_size_t size, png24_image *input_image_p, int verbose)
 {
+    pngquant_error retval = rwpng_check_pixels(data, size, input_image_p);
+    if (retval != SUCCESS) {
+        return retval;
+    }
 #if USE_COCOA
-    return rwpng_read_image24_cocoa(infile, input_image_p);
+    return rwpng_read_image24_cocoa(data, size, input_image_p);
 #else
-    return rwpng_read_image24_libpng(infile, input_image_p, verbose);
+    return rwpng_read_image24_libpng(data, size, input_image_p, verbose);
 #endif
 }
 
 
-static pngquant_error rwpng_write_image_init(rwpng_png_image *mainprog_ptr, png_structpp png_ptr_p, png_infopp info_ptr_p, int fast_compression)
+static pngquant_error rwpng_write_image_init(rwpng_png_image *mainprog_ptr, const rwpng_allocator *allocator, png_structpp png_ptr_p, png_infopp info_ptr_p, int fast_compression)
 {
     /* could also replace libpng warning-handler (final NULL), but no need: */
 
+#ifdef PNG_USER_MEM_SUPPORTED
+    if (allocator) {
+        *png_ptr_p = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, mainprog_ptr, rwpng_error_handler, NULL,
+          (png_voidp)allocator, rwpng_png_malloc, rwpng_png_free);
+    } else
+#endif
     *png_ptr_p = png_create_write_struct(PNG_LIBPNG_VER_STRING, mainprog_ptr, rwpng_error_handler, NULL);
 
     if (!(*png_ptr_p)) {
@@ -438,30 +805,68 @@ void rwpng_set_gamma(png_infop info_ptr, png_structp png_ptr, double gamma)
         png_set_sRGB(png_ptr, info_ptr, 0); // 0 = Perceptual
 }
 
-pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
+static int rwpng_compression_level(const png8_image *mainprog_ptr)
 {
-    png_structp png_ptr;
-    png_infop info_ptr;
+    if (mainprog_ptr->compression_level) return mainprog_ptr->compression_level;
+    return mainprog_ptr->fast_compression ? Z_BEST_SPEED : Z_BEST_COMPRESSION;
+}
 
-    pngquant_error retval = rwpng_write_image_init((rwpng_png_image*)mainprog_ptr, &png_ptr, &info_ptr, mainprog_ptr->fast_compression);
-    if (retval) return retval;
+/* upper bound for a palette PNG that deflate can't shrink at all: raw
+ * rows plus stored-block and IDAT overhead, and the fixed chunks */
+static png_size_t rwpng_estimate_size8(const png8_image *mainprog_ptr, int sample_depth)
+{
+    png_size_t rowbytes = ((png_size_t)mainprog_ptr->width * sample_depth + 7) / 8;
+    png_size_t raw_size = (rowbytes + 1) * mainprog_ptr->height; /* +1 filter byte per row */
 
-    struct rwpng_write_data write_data;
-    if (mainprog_ptr->maximum_file_size) {
-        write_data = (struct rwpng_write_data){
-            .buffer = malloc(mainprog_ptr->maximum_file_size),
-            .bytes_left = mainprog_ptr->maximum_file_size,
-        };
-        if (!write_data.buffer) return PNG_OUT_OF_MEMORY_ERROR;
-        png_set_write_fn(png_ptr, &write_data, user_write_data, user_flush_data);
-    } else {
-        png_init_io(png_ptr, outfile);
+    /* signature, IHDR, PLTE, tRNS, gAMA, sRGB, IEND */
+    png_size_t size = 8 + 25 + (12 + 3 * mainprog_ptr->num_palette) + (12 + mainprog_ptr->num_trans) + 16 + 13 + 12;
+
+    /* zlib header/adler32, 5 bytes per stored block, 12 bytes per 8KB IDAT chunk */
+    size += raw_size + 6 + (raw_size / 16384 + 1) * 5 + (raw_size / 8192 + 1) * 12;
+
+    for(struct rwpng_chunk *chunk = mainprog_ptr->chunks; chunk; chunk = chunk->next) {
+        size += 12 + chunk->size;
     }
+    return size;
+}
 
-    // Palette images generally don't gain anything from filtering
-    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_VALUE_NONE);
+enum { RWPNG_BEFORE_PLTE, RWPNG_BEFORE_IDAT, RWPNG_AFTER_IDAT };
 
-    rwpng_set_gamma(info_ptr, png_ptr, mainprog_ptr->gamma);
+/* Kept chunks are written straight from where they are, without handing
+ * libpng a copy, at the same place relative to PLTE and IDAT they were read. */
+static void rwpng_write_chunks(png_structp png_ptr, const struct rwpng_chunk *chunk, int place)
+{
+    for(; chunk; chunk = chunk->next) {
+        int chunk_place = chunk->location & PNG_AFTER_IDAT ? RWPNG_AFTER_IDAT :
+                          chunk->location & PNG_HAVE_PLTE ? RWPNG_BEFORE_IDAT : RWPNG_BEFORE_PLTE;
+        if (chunk_place == place) {
+            png_write_chunk(png_ptr, chunk->name, chunk->data, chunk->size);
+        }
+    }
+}
+
+/* Hands the encoded file over, shrunk to its size: the buffer was sized for
+ * the worst case, and results are often kept around in batches. */
+static void rwpng_take_output(rwpng_row_writer *writer, unsigned char **data_p, png_size_t *size_p)
+{
+    unsigned char *data = writer->write_data.buffer;
+    if (writer->write_data.bytes_written < writer->write_data.capacity) {
+        unsigned char *shrunk = realloc(data, writer->write_data.bytes_written ? writer->write_data.bytes_written : 1);
+        if (shrunk) data = shrunk;
+    }
+    *data_p = data;
+    *size_p = writer->write_data.bytes_written;
+    writer->write_data.buffer = NULL;
+}
+
+/* rwpng_write_rows_begin() with the output buffer's initial size capped at
+ * max_initial_capacity (0 = sized for the whole image) */
+static pngquant_error rwpng_write_begin(rwpng_row_writer *writer, png8_image *mainprog_ptr, png_size_t max_initial_capacity)
+{
+    *writer = (rwpng_row_writer){};
+
+    pngquant_error retval = rwpng_write_image_init((rwpng_png_image*)mainprog_ptr, mainprog_ptr->allocator, &writer->png_ptr, &writer->info_ptr, mainprog_ptr->fast_compression);
+    if (retval) return retval;
 
     /* set the image parameters appropriately */
     int sample_depth;
@@ -476,25 +881,46 @@ pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
 #endif
         sample_depth = 8;
 
-    struct rwpng_chunk *chunk = mainprog_ptr->chunks;
-    int chunk_num=0;
-    while(chunk) {
-        png_unknown_chunk pngchunk = {
-            .size = chunk->size,
-            .data = chunk->data,
-            .location = chunk->location,
-        };
-        memcpy(pngchunk.name, chunk->name, 5);
-        png_set_unknown_chunks(png_ptr, info_ptr, &pngchunk, 1);
+    writer->write_data = (struct rwpng_write_data){
+        .capacity = rwpng_estimate_size8(mainprog_ptr, sample_depth),
+        .maximum_size = mainprog_ptr->maximum_file_size,
+    };
+    if (writer->write_data.maximum_size && writer->write_data.capacity > writer->write_data.maximum_size) {
+        writer->write_data.capacity = writer->write_data.maximum_size;
+    }
+    if (max_initial_capacity && writer->write_data.capacity > max_initial_capacity) {
+        writer->write_data.capacity = max_initial_capacity;
+    }
+    writer->write_data.buffer = malloc(writer->write_data.capacity);
+    if (!writer->write_data.buffer) {
+        rwpng_write_rows_abort(writer);
+        return PNG_OUT_OF_MEMORY_ERROR;
+    }
+
+    /* the jmpbuf set in rwpng_write_image_init() is gone once it returns,
+     * so errors while encoding need to land here */
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        retval = rwpng_write_error(&writer->write_data);
+        rwpng_write_rows_abort(writer);
+        return retval;
+    }
+
+    png_structp png_ptr = writer->png_ptr;
+    png_infop info_ptr = writer->info_ptr;
 
-        #if defined(PNG_HAVE_IHDR) && PNG_LIBPNG_VER < 10600
-        png_set_unknown_chunk_location(png_ptr, info_ptr, chunk_num, pngchunk.location ? pngchunk.location : PNG_HAVE_IHDR);
-        #endif
+    png_set_write_fn(png_ptr, &writer->write_data, user_write_data, user_flush_data);
 
-        chunk = chunk->next;
-        chunk_num++;
+    png_set_compression_level(png_ptr, rwpng_compression_level(mainprog_ptr));
+    png_set_compression_strategy(png_ptr, mainprog_ptr->compression_strategy);
+    if (mainprog_ptr->compression_mem_level) {
+        png_set_compression_mem_level(png_ptr, mainprog_ptr->compression_mem_level);
     }
 
+    // Palette images generally don't gain anything from filtering
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, mainprog_ptr->row_filters ? mainprog_ptr->row_filters : PNG_FILTER_NONE);
+
+    rwpng_set_gamma(info_ptr, png_ptr, mainprog_ptr->gamma);
+
     png_set_IHDR(png_ptr, info_ptr, mainprog_ptr->width, mainprog_ptr->height,
       sample_depth, PNG_COLOR_TYPE_PALETTE,
       0, PNG_COMPRESSION_TYPE_DEFAULT,
@@ -506,20 +932,363 @@ pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
         png_set_tRNS(png_ptr, info_ptr, mainprog_ptr->trans, mainprog_ptr->num_trans, NULL);
     }
 
-    rwpng_write_end(&info_ptr, &png_ptr, mainprog_ptr->row_pointers);
+    png_write_info_before_PLTE(png_ptr, info_ptr);
+    rwpng_write_chunks(png_ptr, mainprog_ptr->chunks, RWPNG_BEFORE_PLTE);
+    png_write_info(png_ptr, info_ptr);
+    rwpng_write_chunks(png_ptr, mainprog_ptr->chunks, RWPNG_BEFORE_IDAT);
+
+    png_set_packing(png_ptr);
+
+    return SUCCESS;
+}
+
+/* Sets up the encoder and writes everything that comes before the image
+ * data. Rows then go in with rwpng_write_rows(), top to bottom. The output
+ * buffer starts small and grows with the compressed data, so memory stays
+ * proportional to the rows in flight rather than to the whole image. */
+pngquant_error rwpng_write_rows_begin(rwpng_row_writer *writer, png8_image *mainprog_ptr)
+{
+    return rwpng_write_begin(writer, mainprog_ptr, RWPNG_STREAM_BUFFER_BYTES);
+}
 
-    if (mainprog_ptr->maximum_file_size) {
-        if (!write_data.bytes_written) {
+pngquant_error rwpng_write_rows(rwpng_row_writer *writer, png8_image *mainprog_ptr, unsigned char **row_pointers, unsigned int num_rows)
+{
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        pngquant_error retval = rwpng_write_error(&writer->write_data);
+        rwpng_write_rows_abort(writer);
+        return retval;
+    }
+
+    png_write_rows(writer->png_ptr, row_pointers, num_rows);
+    return SUCCESS;
+}
+
+/* On success *data_p is a malloc()ed buffer holding the whole PNG file */
+pngquant_error rwpng_write_rows_end(rwpng_row_writer *writer, png8_image *mainprog_ptr, unsigned char **data_p, png_size_t *size_p)
+{
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        pngquant_error retval = rwpng_write_error(&writer->write_data);
+        rwpng_write_rows_abort(writer);
+        return retval;
+    }
+
+    rwpng_write_chunks(writer->png_ptr, mainprog_ptr->chunks, RWPNG_AFTER_IDAT);
+    png_write_end(writer->png_ptr, NULL);
+    png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+
+    rwpng_take_output(writer, data_p, size_p);
+    return SUCCESS;
+}
+
+void rwpng_write_rows_abort(rwpng_row_writer *writer)
+{
+    if (writer->png_ptr) {
+        png_destroy_write_struct(&writer->png_ptr, writer->info_ptr ? &writer->info_ptr : NULL);
+    }
+    writer->png_ptr = NULL;
+    writer->info_ptr = NULL;
+
+    free(writer->write_data.buffer);
+    writer->write_data.buffer = NULL;
+}
+
+/* Parallel IDAT encoding, the way pigz does it: the filtered rows are split
+ * into bands, each band is deflated as raw deflate on its own thread with the
+ * last 32KB of the previous band as preset dictionary, and the pieces (ended
+ * with a sync flush, the last one with a final block) are concatenated behind
+ * a zlib header. The adler32 checksums of the bands are combined for the
+ * trailer. Compression is within a fraction of a percent of one stream. */
+
+#define RWPNG_BAND_MIN_BYTES (256 * 1024)
+#define RWPNG_DICT_BYTES 32768
+#define RWPNG_IDAT_BYTES (256 * 1024)
+
+struct rwpng_band {
+    unsigned char *data;
+    png_size_t size;
+    png_size_t capacity;
+    png_size_t raw_size;
+    uLong adler;
+    int failed;
+    int too_large; /* gave up because the bands together passed the size cap */
+};
+
+/* what the bands of one image have compressed so far, against the room left
+ * under maximum_file_size (0 = no cap) */
+struct rwpng_band_budget {
+    png_size_t compressed;
+    png_size_t limit;
+};
+
+/* filter byte (always None, as in the libpng path) followed by the row packed to sample_depth */
+static void rwpng_pack_row(unsigned char *dst, const unsigned char *src, png_uint_32 width, int sample_depth)
+{
+    *dst++ = PNG_FILTER_VALUE_NONE;
+    if (sample_depth == 8) {
+        memcpy(dst, src, width);
+        return;
+    }
+
+    const int per_byte = 8 / sample_depth;
+    png_uint_32 x;
+    for(x = 0; x < width; x += per_byte) {
+        unsigned char byte = 0;
+        int i;
+        for(i = 0; i < per_byte; i++) {
+            byte <<= sample_depth;
+            if (x + i < width) byte |= src[x + i];
+        }
+        *dst++ = byte;
+    }
+}
+
+static int rwpng_deflate_band_chunk(z_stream *strm, struct rwpng_band *band, int flush)
+{
+    do {
+        if (!strm->avail_out) {
+            unsigned char *grown = realloc(band->data, band->capacity * 2);
+            if (!grown) return 0;
+            band->data = grown;
+            band->capacity *= 2;
+            strm->next_out = band->data + band->size;
+            strm->avail_out = band->capacity - band->size;
+        }
+        int err = deflate(strm, flush);
+        band->size = strm->next_out - band->data;
+        if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR) return 0;
+    } while (strm->avail_in || !strm->avail_out);
+    return 1;
+}
+
+/* Adds what the band produced since the last call to the shared count.
+ * Returns 0 once the bands together are over the cap, whoever crossed it. */
+static int rwpng_band_within_budget(struct rwpng_band_budget *budget, struct rwpng_band *band, png_size_t *reported)
+{
+    if (!budget->limit) return 1;
+    png_size_t total = __atomic_add_fetch(&budget->compressed, band->size - *reported, __ATOMIC_RELAXED);
+    *reported = band->size;
+    return total <= budget->limit;
+}
+
+static void rwpng_deflate_band(const png8_image *mainprog_ptr, int sample_depth, png_uint_32 first_row, png_uint_32 end_row, int last, int level,
+                               unsigned char *row_buffer, struct rwpng_band_budget *budget, struct rwpng_band *band)
+{
+    png_size_t reported = 0;
+    const png_size_t row_bytes = ((png_size_t)mainprog_ptr->width * sample_depth + 7) / 8 + 1;
+    z_stream strm = {0};
+
+    band->raw_size = row_bytes * (end_row - first_row);
+    band->capacity = band->raw_size / 2 + 1024;
+    band->data = malloc(band->capacity);
+    band->adler = adler32(0, NULL, 0);
+    if (!band->data || deflateInit2(&strm, level, Z_DEFLATED, -15, mainprog_ptr->compression_mem_level ? mainprog_ptr->compression_mem_level : 8,
+                                    mainprog_ptr->compression_strategy) != Z_OK) {
+        band->failed = 1;
+        return;
+    }
+    strm.next_out = band->data;
+    strm.avail_out = band->capacity;
+
+    /* rows just before the band are the history the decoder will have */
+    if (first_row > 0) {
+        png_uint_32 dict_rows = (RWPNG_DICT_BYTES + row_bytes - 1) / row_bytes;
+        png_uint_32 row = first_row > dict_rows ? first_row - dict_rows : 0;
+        unsigned char *dict = malloc(row_bytes * (first_row - row));
+        if (!dict) {
+            band->failed = 1;
+        } else {
+            png_size_t dict_size = 0;
+            for(; row < first_row; row++, dict_size += row_bytes) {
+                rwpng_pack_row(dict + dict_size, mainprog_ptr->row_pointers[row], mainprog_ptr->width, sample_depth);
+            }
+            png_size_t keep = dict_size < RWPNG_DICT_BYTES ? dict_size : RWPNG_DICT_BYTES;
+            deflateSetDictionary(&strm, dict + dict_size - keep, keep);
+            free(dict);
+        }
+    }
+
+    png_uint_32 row;
+    for(row = first_row; row < end_row && !band->failed; row++) {
+        rwpng_pack_row(row_buffer, mainprog_ptr->row_pointers[row], mainprog_ptr->width, sample_depth);
+        band->adler = adler32(band->adler, row_buffer, row_bytes);
+        strm.next_in = row_buffer;
+        strm.avail_in = row_bytes;
+        band->failed = !rwpng_deflate_band_chunk(&strm, band, Z_NO_FLUSH);
+        /* like user_write_data() in the serial path: stop as soon as the
+         * file can't fit anymore, in every band */
+        if (!band->failed && !rwpng_band_within_budget(budget, band, &reported)) {
+            band->failed = band->too_large = 1;
+        }
+    }
+    if (!band->failed) {
+        band->failed = !rwpng_deflate_band_chunk(&strm, band, last ? Z_FINISH : Z_SYNC_FLUSH);
+    }
+    if (!band->failed && !rwpng_band_within_budget(budget, band, &reported)) {
+        band->failed = band->too_large = 1;
+    }
+    deflateEnd(&strm);
+}
+
+/* Number of bands worth splitting the image into; 1 means the plain libpng path */
+static int rwpng_deflate_bands(const png8_image *mainprog_ptr, int sample_depth)
+{
+    png_size_t raw_size = (((png_size_t)mainprog_ptr->width * sample_depth + 7) / 8 + 1) * mainprog_ptr->height;
+    png_size_t bands = raw_size / RWPNG_BAND_MIN_BYTES;
+
+    /* bands are written unfiltered, any other filter goes through libpng */
+    if (mainprog_ptr->row_filters && mainprog_ptr->row_filters != PNG_FILTER_NONE) {
+        return 1;
+    }
+    if (mainprog_ptr->deflate_threads <= 1 || bands < 2) {
+        return 1;
+    }
+    if (bands > (png_size_t)mainprog_ptr->deflate_threads) {
+        bands = mainprog_ptr->deflate_threads;
+    }
+    if (bands > mainprog_ptr->height) {
+        bands = mainprog_ptr->height;
+    }
+    return bands;
+}
+
+/* Writes IDAT and IEND, in place of png_write_rows() + png_write_end() */
+static pngquant_error rwpng_write_idat_parallel(rwpng_row_writer *writer, png8_image *mainprog_ptr, int bands, unsigned char **data_p, png_size_t *size_p)
+{
+    const int sample_depth = png_get_bit_depth(writer->png_ptr, writer->info_ptr);
+    const int level = rwpng_compression_level(mainprog_ptr);
+    const png_size_t row_bytes = ((png_size_t)mainprog_ptr->width * sample_depth + 7) / 8 + 1;
+    const png_uint_32 rows_per_band = (mainprog_ptr->height + bands - 1) / bands;
+    const int threads = bands < mainprog_ptr->deflate_threads ? bands : mainprog_ptr->deflate_threads;
+
+    struct rwpng_band *band = calloc(bands, sizeof(struct rwpng_band));
+    unsigned char *row_buffers = malloc(row_bytes * threads);
+    pngquant_error retval = band && row_buffers ? SUCCESS : PNG_OUT_OF_MEMORY_ERROR;
+
+    struct rwpng_band_budget budget = {0, 0};
+    if (retval == SUCCESS && mainprog_ptr->maximum_file_size) {
+        /* the zlib header and trailer come on top of the bands */
+        png_size_t used = writer->write_data.bytes_written + 2 + 4;
+        if (used >= mainprog_ptr->maximum_file_size) {
+            writer->write_data.too_large = 1;
             retval = TOO_LARGE_FILE;
+        }
+        budget.limit = mainprog_ptr->maximum_file_size - used;
+    }
+
+    if (retval == SUCCESS) {
+        int i;
+        #pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+        for(i = 0; i < bands; i++) {
+            png_uint_32 first_row = i * rows_per_band;
+            png_uint_32 end_row = first_row + rows_per_band < mainprog_ptr->height ? first_row + rows_per_band : mainprog_ptr->height;
+            /* bands still waiting for a thread don't start once the cap is passed */
+            if (budget.limit && __atomic_load_n(&budget.compressed, __ATOMIC_RELAXED) > budget.limit) {
+                band[i].failed = band[i].too_large = 1;
+                continue;
+            }
+            rwpng_deflate_band(mainprog_ptr, sample_depth, first_row, end_row, i == bands - 1, level,
+                               row_buffers + row_bytes * omp_get_thread_num(), &budget, &band[i]);
+        }
+        for(i = 0; i < bands; i++) {
+            if (band[i].too_large) writer->write_data.too_large = 1;
+            if (band[i].failed) retval = writer->write_data.too_large ? TOO_LARGE_FILE : PNG_OUT_OF_MEMORY_ERROR;
+        }
+    }
+
+    /* header: deflate with 32KB window and the level as hint, 31 divides the pair */
+    unsigned char header[2] = {0x78, level <= 1 ? 0x01 : level <= 5 ? 0x5E : level == 6 ? 0x9C : 0xDA};
+    unsigned char trailer[4];
+    const unsigned char **pieces = malloc((bands + 2) * sizeof(*pieces));
+    png_size_t *piece_sizes = malloc((bands + 2) * sizeof(*piece_sizes));
+    png_size_t total = 2 + 4;
+    if (retval == SUCCESS && (!pieces || !piece_sizes)) {
+        retval = PNG_OUT_OF_MEMORY_ERROR;
+    }
+    /* IDAT headers, later chunks and IEND are checked by user_write_data() */
+
+    if (retval == SUCCESS) {
+        uLong adler = band[0].adler;
+        int i;
+        for(i = 0; i < bands; i++) {
+            total += band[i].size;
+            if (i) adler = adler32_combine(adler, band[i].adler, band[i].raw_size);
+            pieces[i + 1] = band[i].data;
+            piece_sizes[i + 1] = band[i].size;
+        }
+        trailer[0] = adler >> 24; trailer[1] = adler >> 16; trailer[2] = adler >> 8; trailer[3] = adler;
+        pieces[0] = header; piece_sizes[0] = 2;
+        pieces[bands + 1] = trailer; piece_sizes[bands + 1] = 4;
+    }
+
+    if (retval == SUCCESS) {
+        if (setjmp(mainprog_ptr->jmpbuf)) {
+            retval = rwpng_write_error(&writer->write_data);
         } else {
-            if (!fwrite(write_data.buffer, 1, write_data.bytes_written, outfile)) {
-                retval = CANT_WRITE_ERROR;
+            png_structp png_ptr = writer->png_ptr;
+
+            /* the stream is cut into IDATs wherever it happens to cross RWPNG_IDAT_BYTES */
+            int piece = 0;
+            png_size_t offset = 0;
+            while (total) {
+                png_size_t idat_size = total < RWPNG_IDAT_BYTES ? total : RWPNG_IDAT_BYTES;
+                png_write_chunk_start(png_ptr, (png_const_bytep)"IDAT", idat_size);
+                total -= idat_size;
+                while (idat_size) {
+                    png_size_t n = piece_sizes[piece] - offset;
+                    if (n > idat_size) n = idat_size;
+                    png_write_chunk_data(png_ptr, pieces[piece] + offset, n);
+                    idat_size -= n;
+                    offset += n;
+                    if (offset == piece_sizes[piece]) {
+                        piece++;
+                        offset = 0;
+                    }
+                }
+                png_write_chunk_end(png_ptr);
             }
+
+            /* same as png_write_end(png_ptr, NULL) in the single-threaded path */
+            rwpng_write_chunks(png_ptr, mainprog_ptr->chunks, RWPNG_AFTER_IDAT);
+            png_write_chunk(png_ptr, (png_const_bytep)"IEND", NULL, 0);
+            png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
         }
+    }
 
-        free(write_data.buffer);
+    if (band) {
+        int i;
+        for(i = 0; i < bands; i++) free(band[i].data);
+    }
+    free(band);
+    free(row_buffers);
+    free(pieces);
+    free(piece_sizes);
+
+    if (retval != SUCCESS) {
+        rwpng_write_rows_abort(writer);
+        return retval;
     }
-    return retval;
+
+    rwpng_take_output(writer, data_p, size_p);
+    return SUCCESS;
+}
+
+/* On success *data_p is a malloc()ed buffer holding the whole PNG file */
+pngquant_error rwpng_write_image8(png8_image *mainprog_ptr, unsigned char **data_p, png_size_t *size_p)
+{
+    rwpng_row_writer writer;
+
+    pngquant_error retval = rwpng_write_begin(&writer, mainprog_ptr, 0);
+    if (retval) return retval;
+
+    int bands = rwpng_deflate_bands(mainprog_ptr, png_get_bit_depth(writer.png_ptr, writer.info_ptr));
+    if (bands > 1) {
+        return rwpng_write_idat_parallel(&writer, mainprog_ptr, bands, data_p, size_p);
+    }
+
+    retval = rwpng_write_rows(&writer, mainprog_ptr, mainprog_ptr->row_pointers, mainprog_ptr->height);
+    if (retval) return retval;
+
+    return rwpng_write_rows_end(&writer, mainprog_ptr, data_p, size_p);
 }
 
 pngquant_error rwpng_write_image24(FILE *outfile, png24_image *mainprog_ptr)
@@ -527,7 +1296,7 @@ pngquant_error rwpng_write_image24(FILE *outfile, png24_image *mainprog_ptr)
     png_structp png_ptr;
     png_infop info_ptr;
 
-    pngquant_error retval = rwpng_write_image_init((rwpng_png_image*)mainprog_ptr, &png_ptr, &info_ptr, 0);
+    pngquant_error retval = rwpng_write_image_init((rwpng_png_image*)mainprog_ptr, mainprog_ptr->allocator, &png_ptr, &info_ptr, 0);
     if (retval) return retval;
 
     png_init_io(png_ptr, outfile);
@@ -551,10 +1320,13 @@ pngquant_error rwpng_write_image24(FILE *outfile, png24_image *mainprog_ptr)
 
 
 static void rwpng_warning_stderr_handler(png_structp png_ptr, png_const_charp msg) {
+    (void)png_ptr;
     fprintf(stderr, "  %s\n", msg);
 }
 
 static void rwpng_warning_silent_handler(png_structp png_ptr, png_const_charp msg) {
+    (void)png_ptr;
+    (void)msg;
 }
 
 static void rwpng_error_handler(png_structp png_ptr, png_const_charp msg)
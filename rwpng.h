@@ -54,6 +54,7 @@ typedef enum {
     PNG_OUT_OF_MEMORY_ERROR = 24,
     LIBPNG_FATAL_ERROR = 25,
     LIBPNG_INIT_ERROR = 35,
+    TOO_MANY_PIXELS = 97,
     TOO_LARGE_FILE = 98,
     TOO_LOW_QUALITY = 99,
 } pngquant_error;
@@ -64,8 +65,25 @@ struct rwpng_chunk {
     png_size_t size;
     png_byte name[5];
     png_byte location;
+    png_byte borrowed; /* data points into the compressed input and isn't freed */
 };
 
+/* which ancillary chunks reading keeps for the output (png24_image.chunk_policy) */
+enum {
+    RWPNG_CHUNKS_UNKNOWN = 0, /* only those libpng doesn't handle itself, e.g. private chunks */
+    RWPNG_CHUNKS_NONE = 1,
+    RWPNG_CHUNKS_ALL = 2,     /* also text, EXIF, pHYs and tIME */
+};
+
+/* optional allocator for what libpng and rwpng allocate while reading or
+ * writing an image (libpng's own state, metadata chunks); the pixel buffers
+ * always come from malloc. NULL means plain malloc/free. */
+typedef struct rwpng_allocator {
+    void *opaque;
+    void *(*malloc_fn)(void *opaque, png_size_t size);
+    void (*free_fn)(void *opaque, void *ptr);
+} rwpng_allocator;
+
 #if USE_LCMS
 typedef enum {
   NONE = 0,
@@ -83,7 +101,16 @@ typedef struct {
     double gamma;
     unsigned char **row_pointers;
     unsigned char *rgba_data;
+    png_size_t rgba_data_capacity;     // bytes allocated in rgba_data, reused by the next read
+    png_uint_32 row_pointers_capacity; // rows allocated in row_pointers, reused by the next read
+    unsigned char *raw_row;            // one row as decoded, before widening to RGBA
+    png_size_t raw_row_capacity;
     struct rwpng_chunk *chunks;
+    const rwpng_allocator *allocator;
+    int chunk_policy;        /* RWPNG_CHUNKS_* */
+    const char *keep_chunks; /* if set, only chunks named here are kept, e.g. "tEXt iTXt eXIf" */
+    char borrow_chunks;      /* kept chunks point into the compressed input, which must outlive them */
+    png_size_t max_pixels;   /* > 0: larger images fail with TOO_MANY_PIXELS before anything is allocated */
 #if USE_LCMS
     lcms_transform lcms_status;
 #endif
@@ -97,12 +124,20 @@ typedef struct {
     double gamma;
     unsigned char **row_pointers;
     unsigned char *indexed_data;
+    png_size_t indexed_data_capacity;
+    png_uint_32 row_pointers_capacity;
     unsigned int num_palette;
     unsigned int num_trans;
     png_color palette[256];
     unsigned char trans[256];
     struct rwpng_chunk *chunks;
-    char fast_compression;
+    const rwpng_allocator *allocator; /* must match the png24_image the chunks came from */
+    char fast_compression;          /* used when compression_level is 0 */
+    int compression_level;          /* zlib level 1-9, 0 = best, or fastest with fast_compression */
+    int compression_strategy;       /* zlib strategy, 0 = Z_DEFAULT_STRATEGY */
+    int compression_mem_level;      /* zlib memLevel 1-9, 0 = zlib's default */
+    int row_filters;                /* PNG_FILTER_* mask, 0 = PNG_FILTER_NONE */
+    int deflate_threads; /* > 1: rwpng_write_image8() deflates bands of rows on this many threads */
 } png8_image;
 
 typedef union {
@@ -111,14 +146,82 @@ typedef union {
     png8_image png8;
 } rwpng_png_image;
 
+/* compressed input, already in memory */
+struct rwpng_read_data {
+    const unsigned char *data;
+    png_size_t size;
+    png_size_t bytes_read;
+};
+
+/* encoded output goes into a growable memory buffer. rwpng_write_image8()
+ * starts it at an upper bound for the image, so it normally never has to
+ * grow; rwpng_write_rows_begin() starts it at RWPNG_STREAM_BUFFER_BYTES, since
+ * a streamed image is too big to reserve for up front. Either way it is
+ * shrunk to the encoded size before it is handed out. */
+#define RWPNG_STREAM_BUFFER_BYTES (4 * 1024 * 1024)
+
+struct rwpng_write_data {
+    unsigned char *buffer;
+    png_size_t bytes_written;
+    png_size_t capacity;
+    png_size_t maximum_size; /* 0 = unlimited */
+    char too_large;
+    char out_of_memory;
+};
+
+/* how rows that libpng decoded without transforms are widened to RGBA8 */
+typedef struct {
+    int channels;   /* of the raw rows; 0 = libpng's transforms produce RGBA8 */
+    int bit_depth;  /* 8 or 16 */
+    int palette;    /* samples are indices into rgba_palette */
+    unsigned char rgba_palette[256][4];
+} rwpng_expander;
+
+/* state for decoding/encoding a few rows at a time, for images that are too
+ * big to keep in memory whole. Not usable with interlaced images. */
+typedef struct {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    struct rwpng_read_data read_data;
+    rwpng_expander expander;
+} rwpng_row_reader;
+
+typedef struct {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    struct rwpng_write_data write_data;
+} rwpng_row_writer;
+
+/* what the signature and IHDR say, read without libpng */
+typedef struct {
+    png_uint_32 width;
+    png_uint_32 height;
+    int bit_depth;
+    int color_type;
+    int interlaced;
+} rwpng_header;
+
 /* prototypes for public functions in rwpng.c */
 
 void rwpng_version_info(FILE *fp);
 
-pngquant_error rwpng_read_image24(FILE *infile, png24_image *mainprog_ptr, int verbose);
-pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr);
+pngquant_error rwpng_read_header(const unsigned char *data, png_size_t size, rwpng_header *header);
+pngquant_error rwpng_read_image24(const unsigned char *data, png_size_t size, png24_image *mainprog_ptr, int verbose);
+pngquant_error rwpng_write_image8(png8_image *mainprog_ptr, unsigned char **data_p, png_size_t *size_p);
 pngquant_error rwpng_write_image24(FILE *outfile, png24_image *mainprog_ptr);
 void rwpng_free_image24(png24_image *);
 void rwpng_free_image8(png8_image *);
+void rwpng_free_chunks(struct rwpng_chunk *chunk, const rwpng_allocator *allocator);
+void rwpng_expand_row(const rwpng_expander *expander, unsigned char *rgba, unsigned char *raw, png_uint_32 width);
+
+pngquant_error rwpng_read_rows_begin(rwpng_row_reader *reader, const unsigned char *data, png_size_t size, png24_image *mainprog_ptr, int verbose);
+pngquant_error rwpng_read_rows(rwpng_row_reader *reader, png24_image *mainprog_ptr, unsigned char **row_pointers, unsigned int num_rows);
+pngquant_error rwpng_read_rows_end(rwpng_row_reader *reader, png24_image *mainprog_ptr);
+void rwpng_read_rows_abort(rwpng_row_reader *reader);
+
+pngquant_error rwpng_write_rows_begin(rwpng_row_writer *writer, png8_image *mainprog_ptr);
+pngquant_error rwpng_write_rows(rwpng_row_writer *writer, png8_image *mainprog_ptr, unsigned char **row_pointers, unsigned int num_rows);
+pngquant_error rwpng_write_rows_end(rwpng_row_writer *writer, png8_image *mainprog_ptr, unsigned char **data_p, png_size_t *size_p);
+void rwpng_write_rows_abort(rwpng_row_writer *writer);
 
 #endif
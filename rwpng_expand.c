@@ -0,0 +1,242 @@
+/*
+** Widening of natively decoded PNG rows to RGBA8, in place of libpng's
+** png_set_expand/filler/gray_to_rgb/strip_16 transforms, which work one
+** pixel at a time. Each conversion has a scalar version and, on x86, SSE2
+** and AVX2 ones; the AVX2 kernels are compiled with a target attribute and
+** only picked when the CPU has AVX2, so the library still runs anywhere.
+**
+** 16-bit samples are reduced to their high byte, exactly like strip_16,
+** so the output is identical to what the libpng transforms produce.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "png.h"
+#include "rwpng.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define RWPNG_EXPAND_X86 1
+#include <immintrin.h>
+#define RWPNG_AVX2 __attribute__((target("avx2")))
+#endif
+
+/* scalar kernels, also used for the tails the vector loops leave */
+
+static void strip16_scalar(unsigned char *dst, const unsigned char *src, png_size_t from, png_size_t samples)
+{
+    for(png_size_t i = from; i < samples; i++) {
+        dst[i] = src[i * 2];
+    }
+}
+
+static void gray_scalar(unsigned char *rgba, const unsigned char *gray, png_uint_32 from, png_uint_32 width)
+{
+    for(png_uint_32 x = from; x < width; x++) {
+        rgba[x*4] = rgba[x*4+1] = rgba[x*4+2] = gray[x];
+        rgba[x*4+3] = 255;
+    }
+}
+
+static void gray_alpha_scalar(unsigned char *rgba, const unsigned char *ga, png_uint_32 from, png_uint_32 width)
+{
+    for(png_uint_32 x = from; x < width; x++) {
+        rgba[x*4] = rgba[x*4+1] = rgba[x*4+2] = ga[x*2];
+        rgba[x*4+3] = ga[x*2+1];
+    }
+}
+
+static void rgb_scalar(unsigned char *rgba, const unsigned char *rgb, png_uint_32 from, png_uint_32 width)
+{
+    for(png_uint_32 x = from; x < width; x++) {
+        rgba[x*4] = rgb[x*3];
+        rgba[x*4+1] = rgb[x*3+1];
+        rgba[x*4+2] = rgb[x*3+2];
+        rgba[x*4+3] = 255;
+    }
+}
+
+static void palette_scalar(unsigned char *rgba, const unsigned char *index, const unsigned char palette[256][4], png_uint_32 from, png_uint_32 width)
+{
+    for(png_uint_32 x = from; x < width; x++) {
+        memcpy(rgba + x*4, palette[index[x]], 4);
+    }
+}
+
+#ifdef RWPNG_EXPAND_X86
+
+/* SSE2: everything except RGB and palette, which need byte shuffles/gathers */
+
+static png_size_t strip16_sse2(unsigned char *dst, const unsigned char *src, png_size_t samples)
+{
+    const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+    png_size_t i = 0;
+    /* the big-endian high byte is the low byte of each little-endian lane;
+     * stores never overtake loads, so dst may be src */
+    for(; i + 16 <= samples; i += 16) {
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i*2)), low_bytes);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i*2 + 16)), low_bytes);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+    }
+    return i;
+}
+
+static png_uint_32 gray_sse2(unsigned char *rgba, const unsigned char *gray, png_uint_32 width)
+{
+    const __m128i opaque = _mm_set1_epi8((char)0xff);
+    png_uint_32 x = 0;
+    for(; x + 16 <= width; x += 16) {
+        __m128i g = _mm_loadu_si128((const __m128i *)(gray + x));
+        __m128i gg_lo = _mm_unpacklo_epi8(g, g), ga_lo = _mm_unpacklo_epi8(g, opaque);
+        __m128i gg_hi = _mm_unpackhi_epi8(g, g), ga_hi = _mm_unpackhi_epi8(g, opaque);
+        _mm_storeu_si128((__m128i *)(rgba + x*4), _mm_unpacklo_epi16(gg_lo, ga_lo));
+        _mm_storeu_si128((__m128i *)(rgba + x*4 + 16), _mm_unpackhi_epi16(gg_lo, ga_lo));
+        _mm_storeu_si128((__m128i *)(rgba + x*4 + 32), _mm_unpacklo_epi16(gg_hi, ga_hi));
+        _mm_storeu_si128((__m128i *)(rgba + x*4 + 48), _mm_unpackhi_epi16(gg_hi, ga_hi));
+    }
+    return x;
+}
+
+static png_uint_32 gray_alpha_sse2(unsigned char *rgba, const unsigned char *ga, png_uint_32 width)
+{
+    const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+    png_uint_32 x = 0;
+    for(; x + 8 <= width; x += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(ga + x*2)); /* g | a<<8 per pixel */
+        __m128i g = _mm_and_si128(v, low_bytes);
+        __m128i gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+        _mm_storeu_si128((__m128i *)(rgba + x*4), _mm_unpacklo_epi16(gg, v));
+        _mm_storeu_si128((__m128i *)(rgba + x*4 + 16), _mm_unpackhi_epi16(gg, v));
+    }
+    return x;
+}
+
+/* AVX2 */
+
+RWPNG_AVX2 static png_size_t strip16_avx2(unsigned char *dst, const unsigned char *src, png_size_t samples)
+{
+    const __m256i low_bytes = _mm256_set1_epi16(0x00ff);
+    png_size_t i = 0;
+    for(; i + 32 <= samples; i += 32) {
+        __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i*2)), low_bytes);
+        __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i*2 + 32)), low_bytes);
+        /* packus works per 128-bit lane, the permute puts the quarters back in order */
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+    }
+    return i;
+}
+
+RWPNG_AVX2 static png_uint_32 gray_avx2(unsigned char *rgba, const unsigned char *gray, png_uint_32 width)
+{
+    const __m256i first = _mm256_setr_epi8(0,0,0,-1, 1,1,1,-1, 2,2,2,-1, 3,3,3,-1, 4,4,4,-1, 5,5,5,-1, 6,6,6,-1, 7,7,7,-1);
+    const __m256i second = _mm256_add_epi8(first, _mm256_setr_epi8(8,8,8,0, 8,8,8,0, 8,8,8,0, 8,8,8,0, 8,8,8,0, 8,8,8,0, 8,8,8,0, 8,8,8,0));
+    const __m256i opaque = _mm256_set1_epi32((int)0xff000000);
+    png_uint_32 x = 0;
+    for(; x + 16 <= width; x += 16) {
+        __m128i g = _mm_loadu_si128((const __m128i *)(gray + x));
+        /* both lanes hold all 16 pixels, so each shuffle can pick any 8 of them */
+        __m256i v = _mm256_broadcastsi128_si256(g);
+        _mm256_storeu_si256((__m256i *)(rgba + x*4), _mm256_or_si256(_mm256_shuffle_epi8(v, first), opaque));
+        _mm256_storeu_si256((__m256i *)(rgba + x*4 + 32), _mm256_or_si256(_mm256_shuffle_epi8(v, second), opaque));
+    }
+    return x;
+}
+
+RWPNG_AVX2 static png_uint_32 gray_alpha_avx2(unsigned char *rgba, const unsigned char *ga, png_uint_32 width)
+{
+    const __m256i low_bytes = _mm256_set1_epi16(0x00ff);
+    png_uint_32 x = 0;
+    for(; x + 16 <= width; x += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(ga + x*2));
+        __m256i g = _mm256_and_si256(v, low_bytes);
+        __m256i gg = _mm256_or_si256(g, _mm256_slli_epi16(g, 8));
+        __m256i lo = _mm256_unpacklo_epi16(gg, v); /* pixels 0-3, 8-11 */
+        __m256i hi = _mm256_unpackhi_epi16(gg, v); /* pixels 4-7, 12-15 */
+        _mm256_storeu_si256((__m256i *)(rgba + x*4), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(rgba + x*4 + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    return x;
+}
+
+RWPNG_AVX2 static png_uint_32 rgb_avx2(unsigned char *rgba, const unsigned char *rgb, png_uint_32 width)
+{
+    const __m256i spread = _mm256_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1,
+                                            0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+    const __m256i opaque = _mm256_set1_epi32((int)0xff000000);
+    png_uint_32 x = 0;
+    /* each 16-byte load uses 12 bytes, so stop early enough not to read past the row */
+    for(; x + 11 <= width; x += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(rgb + x*3));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(rgb + x*3 + 12));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256((__m256i *)(rgba + x*4), _mm256_or_si256(_mm256_shuffle_epi8(v, spread), opaque));
+    }
+    return x;
+}
+
+RWPNG_AVX2 static png_uint_32 palette_avx2(unsigned char *rgba, const unsigned char *index, const unsigned char palette[256][4], png_uint_32 width)
+{
+    png_uint_32 x = 0;
+    for(; x + 8 <= width; x += 8) {
+        __m256i i = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(index + x)));
+        _mm256_storeu_si256((__m256i *)(rgba + x*4), _mm256_i32gather_epi32((const int *)palette, i, 4));
+    }
+    return x;
+}
+
+static int rwpng_has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+static void rwpng_strip16(unsigned char *dst, const unsigned char *src, png_size_t samples, int avx2)
+{
+    png_size_t done = 0;
+#ifdef RWPNG_EXPAND_X86
+    done = avx2 ? strip16_avx2(dst, src, samples) : strip16_sse2(dst, src, samples);
+#endif
+    strip16_scalar(dst, src, done, samples);
+}
+
+/* Fills one RGBA8 row from a row as libpng decoded it without transforms.
+ * The raw row is used as scratch space, so its contents are lost. */
+void rwpng_expand_row(const rwpng_expander *expander, unsigned char *rgba, unsigned char *raw, png_uint_32 width)
+{
+    const int channels = expander->channels;
+    int avx2 = 0;
+    png_uint_32 done = 0;
+
+#ifdef RWPNG_EXPAND_X86
+    avx2 = rwpng_has_avx2();
+#endif
+
+    if (expander->bit_depth == 16) {
+        /* RGBA needs nothing but the strip, straight into the output */
+        rwpng_strip16(channels == 4 ? rgba : raw, raw, (png_size_t)width * channels, avx2);
+        if (channels == 4) return;
+    }
+
+    if (expander->palette) {
+#ifdef RWPNG_EXPAND_X86
+        if (avx2) done = palette_avx2(rgba, raw, expander->rgba_palette, width);
+#endif
+        palette_scalar(rgba, raw, expander->rgba_palette, done, width);
+    } else if (channels == 1) {
+#ifdef RWPNG_EXPAND_X86
+        done = avx2 ? gray_avx2(rgba, raw, width) : gray_sse2(rgba, raw, width);
+#endif
+        gray_scalar(rgba, raw, done, width);
+    } else if (channels == 2) {
+#ifdef RWPNG_EXPAND_X86
+        done = avx2 ? gray_alpha_avx2(rgba, raw, width) : gray_alpha_sse2(rgba, raw, width);
+#endif
+        gray_alpha_scalar(rgba, raw, done, width);
+    } else if (channels == 3) {
+#ifdef RWPNG_EXPAND_X86
+        if (avx2) done = rgb_avx2(rgba, raw, width);
+#endif
+        rgb_scalar(rgba, raw, done, width);
+    }
+}
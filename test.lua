@@ -1,4 +1,367 @@
 q = require "imagequant"
-f = io.open("/tmp/test.png", "rb")
-str, err = f:read("*all")
-print(q.convert(str,10))
+bit = require "bit"
+
+-- Round trips on generated images, so nothing has to be on disk first.
+
+function be32(n)
+  return string.char(bit.band(bit.rshift(n, 24), 255), bit.band(bit.rshift(n, 16), 255),
+                     bit.band(bit.rshift(n, 8), 255), bit.band(n, 255))
+end
+
+function le16(n)
+  return string.char(n % 256, math.floor(n / 256))
+end
+
+function crc32(s)
+  local c = 0xffffffff
+  for i = 1, #s do
+    c = bit.bxor(c, s:byte(i))
+    for _ = 1, 8 do
+      c = bit.bxor(bit.rshift(c, 1), bit.band(0xedb88320, -bit.band(c, 1)))
+    end
+  end
+  return bit.bnot(c)
+end
+
+function adler32(s)
+  local a, b = 1, 0
+  for i = 1, #s do
+    a = (a + s:byte(i)) % 65521
+    b = (b + a) % 65521
+  end
+  return b * 65536 + a
+end
+
+function png_chunk(name, data)
+  return be32(#data) .. name .. data .. be32(crc32(name .. data))
+end
+
+-- 8-bit PNG of packed samples (color_type 0 gray, 2 RGB, 4 gray+alpha,
+-- 6 RGBA = default), in stored (uncompressed) deflate blocks
+function encode(samples, width, height, color_type)
+  color_type = color_type or 6
+  local row_bytes = width * ({[0] = 1, [2] = 3, [4] = 2, [6] = 4})[color_type]
+  local rows = {}
+  for y = 0, height - 1 do
+    rows[#rows + 1] = "\0" .. samples:sub(y * row_bytes + 1, (y + 1) * row_bytes)
+  end
+  local raw = table.concat(rows)
+  local blocks = {"\120\1"}
+  for pos = 1, #raw, 65535 do
+    local block = raw:sub(pos, pos + 65534)
+    blocks[#blocks + 1] = (pos + 65535 > #raw and "\1" or "\0") .. le16(#block) .. le16(65535 - #block) .. block
+  end
+  blocks[#blocks + 1] = be32(adler32(raw))
+  return "\137PNG\r\n\26\n" .. png_chunk("IHDR", be32(width) .. be32(height) .. "\8" .. string.char(color_type) .. "\0\0\0") ..
+         png_chunk("IDAT", table.concat(blocks)) .. png_chunk("IEND", "")
+end
+
+-- data of the first chunk called name, or nil
+function chunk(png, name)
+  local pos = 9
+  while pos + 8 <= #png do
+    local b1, b2, b3, b4 = png:byte(pos, pos + 3)
+    local len = ((b1 * 256 + b2) * 256 + b3) * 256 + b4
+    if png:sub(pos + 4, pos + 7) == name then
+      return png:sub(pos + 8, pos + 7 + len)
+    end
+    pos = pos + 12 + len
+  end
+end
+
+-- png with a chunk added after IHDR
+function with_chunk(png, name, data)
+  return png:sub(1, 33) .. png_chunk(name, data) .. png:sub(34)
+end
+
+-- width x height RGBA from fn(x, y) -> r, g, b, a, and the same pixels with
+-- fully transparent ones zeroed, which is how they come back
+function image(width, height, fn)
+  local raw, expected = {}, {}
+  for y = 0, height - 1 do
+    for x = 0, width - 1 do
+      local r, g, b, a = fn(x, y)
+      raw[#raw + 1] = string.char(r, g, b, a)
+      expected[#expected + 1] = a == 0 and "\0\0\0\0" or raw[#raw]
+    end
+  end
+  return table.concat(raw), table.concat(expected)
+end
+
+-- under 256 colors: opaque, translucent, and transparent with varying RGB
+few, few_expected = image(64, 64, function(x, y)
+  if (x + y) % 9 == 0 then return x % 3 * 10, y % 3 * 10, 7, 0 end
+  if x < 8 then return 200, 50, 50, 128 + y % 4 * 16 end
+  return x % 6 * 40, y % 6 * 40, 100, 255
+end)
+few_png = encode(few, 64, 64)
+-- thousands of colors, so it goes through libimagequant
+many = image(256, 256, function(x, y) return x, y, (x + y) % 256, 255 end)
+many_png = encode(many, 256, 256)
+many2 = image(256, 256, function(x, y) return y, x, (x * y) % 256, 255 end)
+many2_png = encode(many2, 256, 256)
+
+compressed, info = assert(q.convert(many_png, 10))
+assert(compressed:sub(1, 8) == "\137PNG\r\n\26\n" and chunk(compressed, "IHDR"):sub(1, 8) == be32(256) .. be32(256))
+assert(chunk(compressed, "PLTE") and #compressed < #many_png)
+assert(q.convert("not a png", 10) == nil)
+
+ctx = assert(q.new{speed=10})
+assert(ctx:convert(many_png) and ctx:error() == nil)
+compressed, err = ctx:convert("not a png")
+assert(compressed == nil and err == "libpng fatal error" and ctx:error() == err)
+assert(q.new{speed=11} == nil)
+
+-- decodes an output back to RGBA; <= 256 color images come back exact
+function decode(png)
+  local ix = assert(q.new{speed=10}:quantize(png))
+  local px = {}
+  for i = 0, ix.width * ix.height - 1 do
+    local c = ix.palette[ix.pixels[i]]
+    px[#px + 1] = c[3] == 0 and "\0\0\0\0" or string.char(c[0], c[1], c[2], c[3])
+  end
+  return table.concat(px), ix.width, ix.height
+end
+
+-- raw pixels in and out
+ctx = q.new{speed=10}
+assert(ctx:convert_rgba(few, 64, 64) == ctx:convert(few_png))
+padded = few:gsub(string.rep(".", 64 * 4), "%0padding")
+assert(decode(ctx:convert_rgba(padded, 64, 64, 64 * 4 + 7)) == few_expected)
+assert(ctx:convert_rgba(few, 64, 64, 64 * 4 - 1) == nil and ctx:error() == "invalid argument")
+indexed = assert(ctx:quantize_rgba(many, 256, 256))
+assert(indexed.width == 256 and indexed.height == 256 and indexed.palette_count <= 256)
+assert(indexed.pixels[255 * 256 + 255] < indexed.palette_count)
+
+-- batch: results in input order, false where an image failed
+results, converted = q.convert_batch({many_png, "not a png", few_png}, {speed=10, threads=2})
+assert(converted == 2 and #results == 3 and results[2] == false)
+assert(results[1] == q.new{speed=10}:convert(many_png))
+assert(decode(results[3]) == few_expected)
+
+-- async: the job owns a copy of its input
+job = assert(q.convert_async(many_png .. "", {speed=10}))
+collectgarbage()
+compressed = assert(job:wait())
+assert(job:ready())
+assert(compressed == q.new{speed=10, encode_threads=1, remap_threads=1}:convert(many_png))
+assert(q.convert_async("not a png", {speed=10}):wait() == nil)
+q.convert_async(many_png, {speed=10}) -- dropped unfinished, collected by its worker
+
+-- streaming decodes to the same pixels as converting the whole image
+whole = assert(q.new{speed=10, dithering=q.DITHER_NONE}:convert(many_png))
+streamed = assert(q.new{speed=10, dithering=q.DITHER_NONE, stream_rows=16}:convert(many_png))
+assert(decode(whole) == decode(streamed))
+assert(decode(q.new{speed=10, stream_rows=7}:convert(few_png)) == few_expected)
+
+-- palette cache: the second conversion hits and reports the same quality
+assert(q.palette_cache_configure(1024 * 1024))
+ctx = q.new{speed=10, stats=1}
+first, first_info = assert(ctx:convert(many_png))
+second, second_info = assert(ctx:convert(many_png))
+cache = q.palette_cache_stats()
+assert(cache.hits == 1 and cache.misses == 1 and cache.entries == 1)
+assert(second_info.stats.cache_hits == 1)
+assert(first == second and first_info.quality == second_info.quality and first_info.mse == second_info.mse)
+q.palette_cache_configure(0)
+
+-- shared palette: every frame carries the same PLTE and tRNS
+frames, converted = q.convert_shared_palette({many_png, "not a png", many2_png}, {speed=10})
+assert(converted == 2 and frames[2] == false)
+assert(chunk(frames[1], "PLTE") == chunk(frames[3], "PLTE"))
+assert(chunk(frames[1], "tRNS") == chunk(frames[3], "tRNS"))
+assert(decode(frames[1]) ~= decode(frames[3]))
+
+-- stats: per result and summed over the process
+q.reset_cumulative_stats()
+compressed, info = assert(q.new{speed=10, stats=1}:convert(many_png))
+assert(info.stats.images == 1 and info.stats.bytes_in == #many_png and info.stats.bytes_out == #compressed)
+assert(info.stats.pixels == 256 * 256 and info.stats.total_ns > 0)
+assert(q.new{speed=10, stats=1}:convert("not a png") == nil)
+totals = q.cumulative_stats()
+assert(totals.images == 2 and totals.failures == 1 and totals.bytes_in == #many_png + 9)
+q.reset_cumulative_stats()
+assert(q.cumulative_stats().images == 0)
+
+-- parallel deflate writes a valid PNG with the same pixels
+big, big_expected = image(1024, 1024, function(x, y)
+  local c = (x * 7 + y * 13 + x * y % 5) % 200
+  return c, 255 - c, c * 3 % 256, 255
+end)
+serial = assert(q.new{speed=10, encode_threads=1}:convert_rgba(big, 1024, 1024))
+parallel = assert(q.new{speed=10, encode_threads=4}:convert_rgba(big, 1024, 1024))
+assert(decode(serial) == big_expected and decode(parallel) == big_expected)
+
+-- encode policy: a size cap fails fast, serial or parallel
+for _, threads in ipairs({1, 4}) do
+  compressed, err = q.new{speed=10, encode_threads=threads, max_size=math.floor(#parallel / 2)}:convert_rgba(big, 1024, 1024)
+  assert(compressed == nil and err == "file too large")
+end
+fast = assert(q.new{speed=10, compression_level=1}:convert_rgba(big, 1024, 1024))
+auto = assert(q.new{speed=10, compression_level=q.COMPRESSION_AUTO, time_budget_ms=1}:convert_rgba(big, 1024, 1024))
+assert(decode(fast) == big_expected and decode(auto) == big_expected)
+filtered = assert(q.new{speed=10, row_filters=0xf8}:convert_rgba(big, 1024, 1024))
+assert(decode(filtered) == big_expected)
+
+-- gray, gray+alpha and RGB inputs are widened to the same RGBA
+gray = few_expected:gsub("(.)...", "%1")
+gray_alpha = few_expected:gsub("(.)..(.)", "%1%2")
+rgb = few_expected:gsub("(...).", "%1")
+assert(decode(q.new{speed=10}:convert(encode(gray, 64, 64, 0))) == gray:gsub(".", "%0%0%0\255"))
+assert(decode(q.new{speed=10}:convert(encode(gray_alpha, 64, 64, 4))) ==
+       gray_alpha:gsub("(.)(.)", function(v, a) return a == "\0" and "\0\0\0\0" or v .. v .. v .. a end))
+assert(decode(q.new{speed=10}:convert(encode(rgb, 64, 64, 2))) == rgb:gsub("...", "%0\255"))
+
+-- <= 256 colors: lossless, without quantizing
+compressed, info = assert(q.new{speed=10, stats=1}:convert(few_png))
+assert(info.stats.exact_palettes == 1 and info.quality == 100 and info.mse == 0)
+assert(decode(compressed) == few_expected)
+
+-- resize: fits the box with the aspect ratio kept, either filter
+for _, filter in ipairs({q.RESIZE_BOX, q.RESIZE_LANCZOS}) do
+  compressed = assert(q.new{speed=10, resize_width=100, resize_height=40, resize_filter=filter}:convert(many_png))
+  assert(select(2, decode(compressed)) == 40 and select(3, decode(compressed)) == 40)
+end
+solid = image(64, 64, function() return 10, 200, 30, 255 end)
+compressed = assert(q.new{speed=10, resize_width=7}:convert(encode(solid, 64, 64)))
+assert(decode(compressed) == string.rep("\10\200\30\255", 7 * 7))
+assert(select(2, decode(q.new{speed=10, resize_width=1000}:convert(few_png))) == 64)
+
+-- variants: each within its palette size
+tiers, converted = q.convert_variants(many_png, {{max_colors=256}, {max_colors=16}, {max_colors=2}}, {speed=10})
+assert(converted == 3)
+for i, colors in ipairs({256, 16, 2}) do
+  assert(#chunk(tiers[i], "PLTE") <= colors * 3)
+  assert(select(2, decode(tiers[i])) == 256)
+end
+tiers = q.convert_variants(few_png, {{max_colors=256}, {max_colors=8}}, {speed=10})
+assert(decode(tiers[1]) == few_expected and #chunk(tiers[2], "PLTE") <= 8 * 3)
+
+-- file to file, replacing the output atomically
+in_path, out_path = os.tmpname(), os.tmpname()
+f = assert(io.open(in_path, "wb"))
+f:write(many_png)
+f:close()
+assert(q.convert_file(in_path, out_path, {speed=10}))
+f = assert(io.open(out_path, "rb"))
+assert(f:read("*all") == q.new{speed=10}:convert(many_png))
+f:close()
+assert(q.new{speed=10, sync=1}:convert_file(out_path, out_path))
+f = assert(io.open(out_path, "rb"))
+assert(f:read("*all") == q.new{speed=10}:convert(q.new{speed=10}:convert(many_png)))
+f:close()
+-- a context reads the next, smaller file into the same buffer
+context = q.new{speed=10}
+assert(context:convert_file(in_path, out_path) and context:convert_file(out_path, out_path))
+ok, err = q.convert_file(in_path .. ".missing", out_path)
+assert(ok == nil and err == "read error")
+os.remove(in_path)
+os.remove(out_path)
+
+-- quality: reported, and quality_min refuses palettes that can't reach it
+compressed, info = assert(q.new{speed=10}:convert(many_png))
+assert(info.quality >= 0 and info.quality <= 100 and info.mse >= 0)
+compressed, err = q.new{speed=10, stats=1, quality_min=100}:convert(many_png)
+assert(compressed == nil and err == "quality is too low")
+
+-- banded remapping gives the same pixels as one pass, and shares the palette
+wide, wide_expected = image(1024, 512, function(x, y) return x % 256, y % 256, (x + y) % 256, 255 end)
+wide_png = encode(wide, 1024, 512)
+one_pass = assert(q.new{speed=10, remap_threads=1, dithering=q.DITHER_NONE}:convert(wide_png))
+banded = assert(q.new{speed=10, remap_threads=4, dithering=q.DITHER_NONE}:convert(wide_png))
+assert(decode(one_pass) == decode(banded))
+one_pass = assert(q.new{speed=10, remap_threads=1}:convert(wide_png))
+banded = assert(q.new{speed=10, remap_threads=4}:convert(wide_png))
+assert(chunk(one_pass, "PLTE") == chunk(banded, "PLTE"))
+-- dithered bands start from error diffusion that has been running above them,
+-- so the rows at their seams are no worse than the same rows in one pass
+seed = 1
+photo = image(1024, 512, function(x, y)
+  seed = (seed * 1103515245 + 12345) % 2147483648
+  local noise = seed % 24 - 12
+  local sky = math.floor(120 + 100 * math.sin(x / 97) * math.cos(y / 61))
+  return math.max(0, math.min(255, sky + noise)), (x + 2 * y) % 256, math.floor(128 + 96 * math.sin((x + y) / 37)), 255
+end)
+function row_error(indexed, y)
+  local total = 0
+  for x = 0, indexed.width - 1 do
+    local c, i = indexed.palette[indexed.pixels[y * indexed.width + x]], (y * indexed.width + x) * 4
+    for k = 0, 2 do
+      total = total + math.abs(c[k] - photo:byte(i + k + 1))
+    end
+  end
+  return total
+end
+one_pass = assert(q.new{speed=10, remap_threads=1}:quantize_rgba(photo, 1024, 512))
+banded = assert(q.new{speed=10, remap_threads=4}:quantize_rgba(photo, 1024, 512))
+for _, seam in ipairs{128, 256, 384} do
+  local a, b = 0, 0
+  for y = seam, seam + 3 do
+    a, b = a + row_error(one_pass, y), b + row_error(banded, y)
+  end
+  assert(b <= a * 1.25, seam)
+end
+-- remap_threads bands the resize too, with the same pixels as one thread
+one_pass = assert(q.new{speed=10, remap_threads=1, dithering=q.DITHER_NONE, resize_width=300, resize_filter=q.RESIZE_LANCZOS}:convert(wide_png))
+banded = assert(q.new{speed=10, remap_threads=4, dithering=q.DITHER_NONE, resize_width=300, resize_filter=q.RESIZE_LANCZOS}:convert(wide_png))
+assert(select(2, decode(banded)) == 300 and decode(one_pass) == decode(banded))
+
+-- palette ordering: translucent entries first, one fully transparent entry
+trns = assert(chunk(q.new{speed=10}:convert(few_png), "tRNS"))
+transparent = 0
+for i = 1, #trns do
+  assert(trns:byte(i) < 255)
+  if trns:byte(i) == 0 then transparent = transparent + 1 end
+end
+assert(transparent == 1 and #trns == 5)
+
+-- entries that differ only in the lowest bit of alpha stay apart
+lsb, lsb_expected = image(16, 16, function(x, y)
+  local alpha = ({254, 255, 2, 3})[(x + y) % 4 + 1]
+  return 10, 20, 30, x < 8 and alpha or 0
+end)
+compressed = assert(q.new{speed=10}:convert_rgba(lsb, 16, 16))
+assert(decode(compressed) == lsb_expected)
+
+-- chunk policy
+tagged = with_chunk(with_chunk(few_png, "tEXt", "Comment\0hello"), "prVt", "private")
+out = assert(q.new{speed=10}:convert(tagged))
+assert(chunk(out, "prVt") == "private" and chunk(out, "tEXt") == nil)
+out = assert(q.new{speed=10, chunks=q.CHUNKS_NONE}:convert(tagged))
+assert(chunk(out, "prVt") == nil and chunk(out, "tEXt") == nil)
+out = assert(q.new{speed=10, chunks=q.CHUNKS_ALL}:convert(tagged))
+assert(chunk(out, "prVt") == "private" and chunk(out, "tEXt") == "Comment\0hello")
+out = assert(q.new{speed=10, chunks=q.CHUNKS_ALL, keep_chunks="tEXt"}:convert(tagged))
+assert(chunk(out, "prVt") == nil and chunk(out, "tEXt") == "Comment\0hello")
+assert(decode(out) == few_expected)
+out = assert(q.new{speed=10, chunks=q.CHUNKS_ALL, stream_rows=16}:convert(tagged))
+assert(chunk(out, "prVt") == "private" and chunk(out, "tEXt") == "Comment\0hello")
+-- streaming decodes twice but copies the chunks once, and the context keeps its policy
+tagged = with_chunk(with_chunk(many_png, "tEXt", "Comment\0hello"), "prVt", "private")
+streaming = q.new{speed=10, keep_chunks="tEXt", stream_rows=16}
+for _ = 1, 2 do
+  out = assert(streaming:convert(tagged))
+  assert(chunk(out, "prVt") == nil and chunk(out, "tEXt") == "Comment\0hello")
+  assert(select(2, out:gsub("tEXt", "")) == 1)
+end
+
+-- sampling: a palette from a few pixels still remaps every one of them
+compressed = assert(q.new{speed=10, sample_pixels=4096}:convert(many_png))
+assert(select(2, decode(compressed)) == 256)
+assert(q.new{speed=10, sample_pixels=q.SAMPLE_ALL}:convert(many_png))
+
+-- probe and max_pixels
+info = assert(q.probe(few_png))
+assert(info.width == 64 and info.height == 64 and info.complete and info.remap_pixels == 64 * 64)
+assert(info.chunks[1].name == "IHDR" and info.chunks[#info.chunks].name == "IEND")
+assert(q.probe(few_png, {resize_width=-5}).remap_pixels == 64 * 64)
+assert(q.probe(few_png, {resize_width=32}).remap_pixels == 32 * 32)
+assert(q.probe(few_png:sub(1, 50)).complete == false)
+assert(q.probe("not a png") == nil)
+info, err = q.probe(few_png, {max_pixels=1000})
+assert(info.width == 64 and err == "too many pixels")
+compressed, err = q.new{max_pixels=1000}:convert(few_png)
+assert(compressed == nil and err == "too many pixels")
+assert(q.new{max_pixels=64 * 64}:convert(few_png))
+
+print("ok")